@@ -3,6 +3,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include "arena.h"
 
@@ -11,74 +14,200 @@
 
 #define MMAP_SIZE  (1ul << 32)
 #define ALIGN      (sizeof(char *))
+#define RELEASE    (1ul << 22)
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
 
 static void debug_log (Arena *a, bool dump, const char *str, ...) {
 #ifdef ARENA_DEBUG
     if (!a->debug_fp) return;
-    fprintf(a->debug_fp, "DEBUG: arena dump, ");
+    fprintf(a->debug_fp, "DEBUG: arena %s, ", a->name);
     va_list args;
     va_start(args, str);
     vfprintf(a->debug_fp, str, args);
     va_end(args);
     if (dump) {
-        fprintf(a->debug_fp, "DEBUG: arena dump, name %s\n", a->name);
-        fprintf(a->debug_fp, "DEBUG: arena dump, size %zu\n", a->size);
-        fprintf(a->debug_fp, "DEBUG: arena dump, cap  %zu\n", a->cap);
-        fprintf(a->debug_fp, "DEBUG: arena dump, data %p\n", a->data);
-        fprintf(a->debug_fp, "DEBUG: arena dump, flag %u\n", a->flag);
+        fprintf(a->debug_fp, "DEBUG: arena %s, size %zu cap %zu data %p flag %u\n",
+                a->name, a->size, a->cap, a->data, a->flag);
     }
 #endif
 }
 
 
+static inline void stats_alloc (Arena *a, size_t bytes) {
+    ArenaStats *s = &a->stats;
+    if (a->flag & ARENA_ATOMIC) {
+        size_t live = __atomic_add_fetch (&s->live, bytes, __ATOMIC_RELAXED);
+        size_t peak = __atomic_load_n (&s->peak, __ATOMIC_RELAXED);
+        while (live > peak &&
+               !__atomic_compare_exchange_n (&s->peak, &peak, live, true,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+        __atomic_add_fetch (&s->nalloc, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    s->live += bytes;
+    s->peak  = s->live > s->peak ? s->live : s->peak;
+    s->nalloc++;
+}
+
+
+static inline void stats_free (Arena *a, size_t bytes) {
+    a->stats.live -= bytes;
+    a->stats.nfree++;
+}
+
+
+static inline void stats_copy (Arena *a, size_t bytes, uint64_t ns) {
+    ArenaStats *s = &a->stats;
+    if (a->flag & ARENA_ATOMIC) {
+        __atomic_add_fetch (&s->copy_ns, ns, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&s->copied, bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&s->ncopy, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    s->copy_ns += ns;
+    s->copied  += bytes;
+    s->ncopy++;
+}
+
+
+static inline uint64_t now_ns (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/* Commit [from, to) of the reservation. */
+static bool arena_commit (Arena *a, size_t from, size_t to) {
+    if (mprotect (a->data + from, to - from, PROT_READ | PROT_WRITE) == -1) {
+        arena_err ("mprotect");
+        return false;
+    }
+
+    // fault the pages in now rather than one by one on first touch.
+    if ((a->flag & ARENA_POPULATE) &&
+        madvise (a->data + from, to - from, MADV_POPULATE_WRITE) == -1) {
+        debug_log (a, false, "arena_commit - populate failed\n");
+    }
+    return true;
+}
+
+
+/* Next cap that covers `minsz`, bounded by the reservation. */
+static size_t arena_next_cap (Arena *a, size_t cap, size_t minsz) {
+    if (minsz > a->reserve)
+        return 0;
+
+    while (cap < minsz) {
+        cap *= a->growth;
+    }
+    cap = (cap + a->pgsz - 1) & ~(a->pgsz - 1);
+    return cap < a->reserve ? cap : a->reserve;
+}
+
+
+/* Grow an `ARENA_ATOMIC` arena. Racing threads may commit overlapping
+ * ranges, which is harmless, and the cap only ever moves forward.
+ * */
+static bool arena_grow_atomic (Arena *a, size_t minsz) {
+    size_t cap = __atomic_load_n (&a->cap, __ATOMIC_ACQUIRE);
+    while (cap < minsz) {
+        size_t new_cap = arena_next_cap (a, cap, minsz);
+        if (new_cap == 0)
+            return false;
+
+        if (!arena_commit (a, cap, new_cap))
+            return false;
+
+        if (__atomic_compare_exchange_n (&a->cap, &cap, new_cap, false,
+                                         __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            break;
+    }
+    return true;
+}
+
+
 static bool arena_grow (Arena *a, size_t minsz) {
     if (!(a->flag & ARENA_CANGROW))
         return false;
 
-    // double the cap untill it exceed the minsz
-    size_t cap;
-    for (cap = a->cap << 1; cap < minsz; cap <<= 1) ;
+    // multiply the cap by the growth factor untill it exceed the minsz
+    size_t cap = arena_next_cap (a, a->cap, minsz);
+    if (cap == 0)
+        return false;
 
-    if (mprotect (a->data + a->cap, cap - a->cap, PROT_READ | PROT_WRITE) == -1) {
-        arena_err ("mprotect");
+    if (!arena_commit (a, a->cap, cap))
         return false;
-    }
 
     a->cap = cap;
     return true;
 }
 
 
+/* Create an arena with default options: a 4 GiB reservation, one
+ * committed page, doubling growth.
+ * */
 Arena arena_new (const char *name) {
-    size_t pgsz = sysconf (_SC_PAGE_SIZE);
+    return arena_new_opts (name, NULL);
+}
+
+
+/* Create an arena. Zero fields in `opts`, or a NULL `opts`, take the
+ * defaults of `arena_new`. Only `commit` bytes are backed up front,
+ * the rest of `reserve` is address space that is committed as the
+ * arena grows by `growth` times at a time.
+ * */
+Arena arena_new_opts (const char *name, const ArenaOpts *opts) {
+    ArenaOpts o = opts ? *opts : (ArenaOpts){0};
+
+    long pgsz = sysconf (_SC_PAGE_SIZE);
     if (pgsz == -1) {
         arena_err ("sysconf");
         return (Arena){0};
     }
 
-    void *p = mmap (NULL, MMAP_SIZE, PROT_NONE,
-                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (o.reserve == 0) o.reserve = MMAP_SIZE;
+    if (o.commit == 0)  o.commit  = pgsz;
+    if (o.growth < 2)   o.growth  = 2;
+    o.reserve = (o.reserve + pgsz - 1) & ~(pgsz - 1);
+    o.commit  = (o.commit + pgsz - 1) & ~(pgsz - 1);
+    if (o.commit > o.reserve) o.commit = o.reserve;
+
+    void *p = mmap (NULL, o.reserve, PROT_NONE,
+                    MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
     if (p == MAP_FAILED) {
-        arena_err ("sysconf");
+        arena_err ("mmap");
         return (Arena){0};
     }
 
-    if (mprotect (p, pgsz, PROT_READ | PROT_WRITE) == -1) {
-        arena_err ("mprotect");
-        if (munmap (p, MMAP_SIZE) == -1) {
-            arena_err ("munmap");
-        }
-        return (Arena){0};
+    // best effort, THP may be disabled on this kernel.
+    if (o.hugepage) {
+        madvise (p, o.reserve, MADV_HUGEPAGE);
     }
 
     Arena a = {
-        .name = name,
-        .data = p,
-        .cap  = pgsz,
-        .size = 0,
-        .flag = ARENA_CANGROW,
+        .name    = name,
+        .data    = p,
+        .cap     = 0,
+        .size    = 0,
+        .flag    = ARENA_CANGROW | (o.populate ? ARENA_POPULATE : 0),
+        .pgsz    = pgsz,
+        .release = RELEASE,
+        .reserve = o.reserve,
+        .growth  = o.growth,
     };
 
+    if (!arena_commit (&a, 0, o.commit)) {
+        if (munmap (p, o.reserve) == -1) {
+            arena_err ("munmap");
+        }
+        return (Arena){0};
+    }
+    a.cap = o.commit;
+
 #ifdef DEBUG
     a.debug_fp = stdout;
 #endif
@@ -86,23 +215,140 @@ Arena arena_new (const char *name) {
     return a;
 }
 
+
+/* Create an arena that can be allocated from by several threads at
+ * once. Allocation is a single atomic bump, blocks are never recycled,
+ * so it suits data handed from one thread to another rather than
+ * scratch memory. `arena_rewind` must not race with allocations.
+ * */
+Arena arena_new_shared (const char *name) {
+    Arena a = arena_new (name);
+    a.flag |= ARENA_ATOMIC;
+    return a;
+}
+
+
+static pthread_key_t  thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static __thread Arena thread_arena;
+
+
+static void thread_arena_delete (void *a) { arena_delete ((Arena *)a); }
+static void thread_key_init (void) { pthread_key_create (&thread_key, thread_arena_delete); }
+
+
+/* The calling thread's own arena. It is created on first use and
+ * unmapped when the thread exits, no locking is needed to use it.
+ * */
+Arena *arena_thread (void) {
+    if (thread_arena.data == NULL) {
+        pthread_once (&thread_once, thread_key_init);
+        thread_arena = arena_new ("thread");
+        if (thread_arena.data == NULL)
+            return NULL;
+        pthread_setspecific (thread_key, &thread_arena);
+    }
+    return &thread_arena;
+}
+
+
+static void *arena_alloc_atomic (Arena *a, size_t size) {
+    size_t real_size = size + sizeof(AMeta);
+    size_t off       = __atomic_fetch_add (&a->size, real_size, __ATOMIC_RELAXED);
+
+    if (off + real_size > __atomic_load_n (&a->cap, __ATOMIC_ACQUIRE)) {
+        if (!arena_grow_atomic (a, off + real_size))
+            return NULL;
+    }
+
+    char *p = a->data + off;
+    ((AMeta *)p)->size = size;
+    stats_alloc (a, real_size);
+    return (void *)(p + sizeof(AMeta));
+}
+
+/* Payload size of a block. Payloads are aligned and always large
+ * enough to hold the free list link.
+ * */
+static inline size_t block_size (size_t size) {
+    if (size < ALIGN) size = ALIGN;
+    return (size + ALIGN - 1) & ~(ALIGN - 1);
+}
+
+
+/* Free list a block of `size` bytes is pushed to. */
+static inline unsigned class_of_block (size_t size) {
+    unsigned e = 63 - __builtin_clzl (size);
+    unsigned c = ((e - 3) << 2) | ((size >> (e - 2)) & 3);
+    return c < ARENA_NCLASSES ? c : ARENA_NCLASSES - 1;
+}
+
+
+/* First free list whose blocks can all serve a request of `size` bytes. */
+static inline unsigned class_of_request (size_t size) {
+    unsigned e = 63 - __builtin_clzl (size);
+    unsigned c = class_of_block (size);
+    return (size & ((1ul << (e - 2)) - 1)) ? c + 1 : c;
+}
+
+
+/* Whether the free block at `p` can be handed out again. Blocks below
+ * the last savepoint stay on their list until a rewind below them, a
+ * block reused after the mark would survive a rewind to it.
+ * */
+static inline bool reusable (const Arena *a, const char *p, size_t size) {
+    return ((AMeta *)(p - sizeof(AMeta)))->size >= size && p - sizeof(AMeta) >= a->data + a->mark;
+}
+
+
 /* Allocate a block from the arena.
  * It will allocate size + sizeof(AMeta) block, and store the
  * meta data at the beginning of the block. The returned pointer
  * is the pointer to the block + sizeof(AMeta).
+ *
+ * A block previously released with `arena_free` is reused if one
+ * of the right size class is available. The reused block keeps its
+ * original size, which is at least `size`.
  * */
 void *arena_alloc (Arena *a, size_t size) {
-    size_t real_size = size + sizeof(AMeta);
-    real_size        = (real_size + ALIGN) & ~(ALIGN - 1);
+    size = block_size (size);
+
+    if (a->flag & ARENA_ATOMIC)
+        return arena_alloc_atomic (a, size);
+
+    // blocks in the request's own class may fit too, try a few of them.
+    void **link = &a->free[class_of_block (size)];
+    for (unsigned n = 0; *link != NULL && n < 4; ++n, link = (void **)*link) {
+        char *p = *link;
+        if (reusable (a, p, size)) {
+            *link = *(void **)p;
+            stats_alloc (a, ((AMeta *)(p - sizeof(AMeta)))->size + sizeof(AMeta));
+            debug_log (a, true, "arena_alloc - reuse. p %p\n", p);
+            return (void *)p;
+        }
+    }
+
+    // look up to one power of two above the request.
+    for (unsigned c = class_of_request (size), n = 0; c < ARENA_NCLASSES && n < 5; ++c, ++n) {
+        char *p = a->free[c];
+        if (p != NULL && reusable (a, p, size)) {
+            a->free[c] = *(void **)p;
+            stats_alloc (a, ((AMeta *)(p - sizeof(AMeta)))->size + sizeof(AMeta));
+            debug_log (a, true, "arena_alloc - reuse. p %p\n", p);
+            return (void *)p;
+        }
+    }
 
-    char *p = a->data + a->size;
+    size_t real_size = size + sizeof(AMeta);
+    char  *p         = a->data + a->size;
     if (a->size + real_size > a->cap) {
         if (!arena_grow (a, a->size + real_size))
             return NULL;
     }
 
     a->size += real_size;
-    ((AMeta *)p)->size = real_size - sizeof(AMeta);
+    ((AMeta *)p)->size = size;
+    stats_alloc (a, real_size);
 
     p += sizeof(AMeta);
     debug_log (a, true, "arena_alloc. p %p\n", p);
@@ -122,10 +368,50 @@ void *arena_calloc (Arena *a, size_t nmemb, size_t size) {
 }
 
 
+/* Whether the block at `p` can move the top of the arena. Blocks
+ * below the last savepoint can not, or the top would sink under a
+ * mark and rewinding to it would hand out memory in use again.
+ * */
+static inline bool is_top (const Arena *a, const char *p, size_t size) {
+    return p + size == a->data + a->size && p - sizeof(AMeta) >= a->data + a->mark;
+}
+
+
+/* Release a block allocated by `arena_alloc`. A block at the top
+ * of the arena is returned to the bump region directly, any other
+ * block is pushed to the free list of its size class. Blocks below
+ * the last savepoint are listed too but not reused while the mark
+ * stands, see `arena_mark`.
+ * */
+void arena_free (Arena *a, void *p) {
+    if (p == NULL || (a->flag & ARENA_ATOMIC))
+        return;
+
+    if ((char *)p < a->data || (char *)p >= a->data + a->size) {
+        debug_log (a, false, "arena_free - out of range. p %p\n", p);
+        return;
+    }
+
+    AMeta *meta = (AMeta *)((char *)p - sizeof(AMeta));
+    stats_free (a, meta->size + sizeof(AMeta));
+    if (is_top (a, p, meta->size)) {
+        a->size -= meta->size + sizeof(AMeta);
+        debug_log (a, true, "arena_free - pop. p %p\n", p);
+        return;
+    }
+
+    unsigned c = class_of_block (meta->size);
+    *(void **)p = a->free[c];
+    a->free[c]  = p;
+    debug_log (a, false, "arena_free - class %u. p %p\n", c, p);
+}
+
+
 /* Reallocate a block allocated by `arena_alloc`. If the new size
  * is smaller than the old size, don't do anything. If the block
  * is at the top of the arena, simply bump the size. Otherwise
- * allocate a new block and memcpy the data to the new location.
+ * allocate a new block, memcpy the data to the new location and
+ * free the old block.
  *
  * Frequently reallocating blocks in the middle of the arena
  * is inefficent and should be avoided.
@@ -137,17 +423,19 @@ void *arena_realloc (Arena *a, void *p, size_t size) {
         return p;
     }
 
-    if ((char *)p < a->data || (char *)p > a->data + a->size) {
-        debug_log (a, "arena_realloc - out of range. p %p\n", p);
+    if ((char *)p < a->data || (char *)p >= a->data + a->size) {
+        debug_log (a, false, "arena_realloc - out of range. p %p\n", p);
         return NULL;
     }
 
     AMeta  *meta      = (AMeta *)((char *)p - sizeof(AMeta));
     size_t  old_size  = meta->size;
-    bool    is_last   = a->data + a->size - old_size == (char *)p;
+    bool    is_last   = !(a->flag & ARENA_ATOMIC) && is_top (a, p, old_size);
 
+    size = block_size (size);
     if (old_size >= size) { // new size is smaller.
         if (is_last) { // last one, we can shrink the size.
+            a->stats.live -= old_size - size;
             meta->size = size;
             a->size = a->size - old_size + size;
             debug_log(a, true, "arena_realloc - shrink. p %p\n", p);
@@ -158,31 +446,164 @@ void *arena_realloc (Arena *a, void *p, size_t size) {
     }
 
     if (is_last) { // last one, simply bump
-        meta->size = size;
         size_t new_size = a->size - old_size + size;
         if (new_size > a->cap) {
             if (!arena_grow (a, new_size)) {
                 return NULL;
             }
         }
+        a->stats.live += size - old_size;
+        a->stats.peak  = a->stats.live > a->stats.peak ? a->stats.live : a->stats.peak;
+        meta->size = size;
         a->size = new_size;
         debug_log (a, true, "arena_realloc - bump. p %p\n", p);
         return p;
     }
 
     void *q = arena_alloc (a, size);
+    if (q == NULL) {
+        return NULL;
+    }
     debug_log (a, false, "arena_realloc - alloc & memcpy. p %p\n", q);
+    uint64_t t0 = now_ns ();
     memcpy (q, p, old_size);
+    stats_copy (a, old_size, now_ns () - t0);
+    arena_free (a, p);
     return q;
 }
 
 
+/* Take a savepoint of the arena. Everything allocated from now on
+ * lies above it: blocks freed before the mark stay on the free lists
+ * but are not recycled, as a rewind could not take them back. They
+ * are reclaimed by a rewind below them.
+ * */
+ArenaMark arena_mark (Arena *a) {
+    a->mark = a->size;
+    return (ArenaMark){ a->size };
+}
+
+
+/* Roll the arena back to a savepoint taken with `arena_mark`. Every
+ * block allocated after the mark is released at once, blocks below
+ * the mark stay valid. Free blocks above the mark leave the lists,
+ * the ones below stay.
+ *
+ * Committed pages more than `release` bytes above the new top are
+ * handed back to the kernel, so repeated mark/rewind cycles settle at
+ * a steady footprint instead of the high-water mark.
+ * */
+void arena_rewind (Arena *a, ArenaMark m) {
+    if (m.size > a->size)
+        return;
+
+    // everything above the mark was live, except blocks on the free lists.
+    a->stats.live -= a->size - m.size;
+    a->size = m.size;
+    a->mark = m.size;
+
+    // free blocks above the mark were not live, they go with the rest.
+    for (unsigned c = 0; c < ARENA_NCLASSES; ++c) {
+        for (void **link = &a->free[c]; *link != NULL; ) {
+            char *p = *link;
+            if (p - sizeof(AMeta) < a->data + m.size) {
+                link = (void **)p;
+                continue;
+            }
+            a->stats.live += ((AMeta *)(p - sizeof(AMeta)))->size + sizeof(AMeta);
+            *link = *(void **)p;
+        }
+    }
+
+    size_t keep = (a->size + a->release + a->pgsz - 1) & ~(a->pgsz - 1);
+    if (keep < a->cap) {
+        if (madvise (a->data + keep, a->cap - keep, MADV_DONTNEED) == -1) {
+            arena_err ("madvise");
+        }
+    }
+    debug_log (a, true, "arena_rewind. size %zu\n", a->size);
+}
+
+
+/* Initialize an empty vector of `elsize` byte elements. The first
+ * segment holds `first` elements, rounded up to a power of two.
+ * */
+void arena_vec_init (ArenaVec *v, Arena *a, size_t elsize, size_t first) {
+    memset (v, 0, sizeof(ArenaVec));
+    v->arena  = a;
+    v->elsize = elsize;
+    while ((1ul << v->shift) < first) {
+        v->shift++;
+    }
+}
+
+
+/* Append an uninitialized element and return its address. Segments
+ * are allocated on demand and kept across `arena_vec_reset`.
+ * */
+void *arena_vec_push (ArenaVec *v) {
+    size_t   i = v->len;
+    unsigned k = 63 - __builtin_clzl ((i >> v->shift) + 1);
+
+    if (k >= v->nsegs) {
+        if (k >= ARENA_VEC_NSEGS)
+            return NULL;
+        if ((v->segs[k] = arena_alloc (v->arena, (v->elsize << v->shift) << k)) == NULL)
+            return NULL;
+        v->nsegs = k + 1;
+    }
+
+    v->len++;
+    return arena_vec_at (v, i);
+}
+
+
+/* Allocate the segments for `n` more elements, so the next `n` pushes
+ * can not fail. Returns false if they could not be allocated.
+ * */
+bool arena_vec_reserve (ArenaVec *v, size_t n) {
+    unsigned k;
+
+    if (n == 0)
+        return true;
+    k = 63 - __builtin_clzl (((v->len + n - 1) >> v->shift) + 1);
+    if (k >= ARENA_VEC_NSEGS)
+        return false;
+    for (; v->nsegs <= k; v->nsegs++) {
+        if ((v->segs[v->nsegs] = arena_alloc (v->arena, (v->elsize << v->shift) << v->nsegs)) == NULL)
+            return false;
+    }
+    return true;
+}
+
+
+/* Print a one line summary of the arena's counters. */
+void arena_report (FILE *fp, const Arena *a) {
+    const ArenaStats *s = &a->stats;
+    fprintf (fp, "arena %-10s live %zu peak %zu top %zu cap %zu allocs %zu frees %zu "
+                 "copies %zu copied %zu copy_ms %.3f\n",
+             a->name, s->live, s->peak, a->size, a->cap, s->nalloc, s->nfree,
+             s->ncopy, s->copied, s->copy_ns / 1e6);
+}
+
+
+/* Unmap the arena. If ARENA_REPORT is set in the environment, its
+ * counters are reported to stderr first.
+ * */
 bool arena_delete (Arena *a) {
-    if (munmap (a->data, MMAP_SIZE) == -1) {
+    if (a->data == NULL)
+        return false;
+
+    if (getenv ("ARENA_REPORT"))
+        arena_report (stderr, a);
+
+    if (munmap (a->data, a->reserve) == -1) {
         arena_err ("munmap");
         return false;
     }
+    a->data = NULL;
     a->cap  = 0;
     a->size = 0;
-    return 0;
+    a->mark = 0;
+    return true;
 }
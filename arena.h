@@ -3,31 +3,115 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <string.h>
+
+/* Freed blocks are kept in segregated free lists. Each power of two
+ * is split into 4 size classes, a block lands in the class whose lower
+ * bound it covers, so every block in a class can serve a request up
+ * to that lower bound.
+ * */
+#define ARENA_NCLASSES 128
+
+
+/* Counters kept on every arena. Byte counts include block headers. */
+typedef struct ArenaStats {
+    size_t   live;    // bytes in allocated blocks.
+    size_t   peak;    // high-water mark of `live`.
+    size_t   nalloc;  // number of allocations, reused blocks included.
+    size_t   nfree;   // number of blocks released by `arena_free`.
+    size_t   ncopy;   // number of relocations in `arena_realloc`.
+    size_t   copied;  // bytes memcpy'd by those relocations.
+    uint64_t copy_ns; // time spent in those memcpys.
+} ArenaStats;
+
 
 typedef struct Arena {
     const char *name;
     char       *data;
     size_t      size;
     size_t      cap;
+    size_t      mark;    // top at the last savepoint, blocks below it are never reused.
     uint8_t     flag;
     FILE       *debug_fp;
+    void       *free[ARENA_NCLASSES]; // free lists, linked through the payload.
+    size_t      pgsz;
+    size_t      release; // committed bytes kept above the top on rewind.
+    size_t      reserve; // reserved address space, `cap` never exceeds it.
+    size_t      growth;  // cap multiplier when the arena grows.
+    ArenaStats  stats;
 } Arena;
 
 
+/* Options for `arena_new_opts`, zero fields take the defaults. */
+typedef struct ArenaOpts {
+    size_t   reserve;  // address space to reserve, 4 GiB by default.
+    size_t   commit;   // bytes committed up front, one page by default.
+    size_t   growth;   // cap multiplier when growing, 2 by default.
+    bool     populate; // pre-fault pages as they are committed.
+    bool     hugepage; // ask for transparent huge pages.
+} ArenaOpts;
+
+
+/* A savepoint of an arena, see `arena_mark` and `arena_rewind`. */
+typedef struct ArenaMark {
+    size_t size;
+} ArenaMark;
+
+
+/* A growable array on an arena. Elements live in segments that double
+ * in size, so a push never relocates and element addresses are stable
+ * for the life of the vector. Segment `k` holds `first << k` elements.
+ * */
+#define ARENA_VEC_NSEGS 40
+
+typedef struct ArenaVec {
+    Arena    *arena;
+    size_t    elsize;
+    size_t    len;
+    unsigned  shift; // log2 of the first segment's capacity.
+    unsigned  nsegs;
+    char     *segs[ARENA_VEC_NSEGS];
+} ArenaVec;
+
+
 typedef struct AMeta {
     size_t size;
 } AMeta;
 
 
 typedef enum ARENA_FLAG {
-    ARENA_CANGROW = (1 << 0)
+    ARENA_CANGROW  = (1 << 0),
+    ARENA_ATOMIC   = (1 << 1), // lock-free bump, safe to share across threads.
+    ARENA_POPULATE = (1 << 2), // pre-fault committed pages.
 } ARENA_FLAG;
 
 
-Arena arena_new (const char *name);
+Arena  arena_new (const char *name);
+Arena  arena_new_opts (const char *name, const ArenaOpts *opts);
+Arena  arena_new_shared (const char *name);
+Arena *arena_thread (void);
 bool  arena_delete (Arena *arena);
 void *arena_alloc (Arena *a, size_t size);
 void *arena_calloc (Arena *a, size_t nmemb, size_t size);
 void *arena_realloc (Arena *a, void *p, size_t size);
+void  arena_free (Arena *a, void *p);
+ArenaMark arena_mark (Arena *a);
+void  arena_rewind (Arena *a, ArenaMark m);
+void  arena_report (FILE *fp, const Arena *a);
+
+static inline void arena_clear (Arena *a) { arena_rewind (a, (ArenaMark){ 0 }); }
+static inline void arena_set_release (Arena *a, size_t bytes) { a->release = bytes; }
+static inline ArenaStats arena_stats (const Arena *a) { return a->stats; }
+
+void  arena_vec_init (ArenaVec *v, Arena *a, size_t elsize, size_t first);
+void *arena_vec_push (ArenaVec *v);
+bool  arena_vec_reserve (ArenaVec *v, size_t n);
+
+static inline void arena_vec_reset (ArenaVec *v) { v->len = 0; }
 
-static inline void arena_clear (Arena *a) { a->size = 0; }
+static inline void *arena_vec_at (const ArenaVec *v, size_t i) {
+    size_t   j   = (i >> v->shift) + 1;
+    unsigned k   = 63 - __builtin_clzl (j);
+    size_t   off = i - (((1ul << k) - 1) << v->shift);
+    return v->segs[k] + off * v->elsize;
+}
@@ -28,6 +28,9 @@
 #include <signal.h>
 #include <poll.h>
 #include <errno.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <termios.h>
 #include <time.h>
 #include <assert.h>
@@ -35,6 +38,9 @@
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 
 
 #define PCRE2_CODE_UNIT_WIDTH 8
@@ -52,20 +58,51 @@ void *(*exp_realloc)(void *ptr, size_t size) = realloc;
 static void debug_buffer (FILE *, const char *);
 
 
-static exp_h * create_handle (void) {
-  exp_h *h = exp_malloc (sizeof *h);
+static void *default_malloc (size_t size, void *data) { return exp_malloc (size); }
+static void default_free (void *ptr, void *data) { exp_free (ptr); }
+static void *default_realloc (void *ptr, size_t size, void *data) { return exp_realloc (ptr, size); }
+
+static const struct exp_allocator default_allocator = {
+  default_malloc, default_free, default_realloc, NULL
+};
+
+#define a_malloc(a, size) ((a)->malloc ((size), (a)->data))
+#define a_free(a, ptr) ((a)->free ((ptr), (a)->data))
+#define a_realloc(a, ptr, size) ((a)->realloc ((ptr), (size), (a)->data))
+
+
+/* How far before `start` a match attempt may look, capped at `start`. */
+static size_t max_lookbehind (const pcre2_code *re, size_t start) {
+  uint32_t lb = 0;
+
+  if (pcre2_pattern_info (re, PCRE2_INFO_MAXLOOKBEHIND, &lb) != 0)
+    lb = 0;
+  return lb < start ? lb : start;
+}
+
+
+static exp_h * create_handle (const struct exp_allocator *a) {
+  exp_h *h = a_malloc (a, sizeof *h);
   if (h == NULL)
     return NULL;
 
   /* Initialize the fields to default values. */
+  h->allocator = a;
   h->fd = -1;
   h->pid = 0;
   h->timeout = 60000;
-  h->read_size = 1024;
+  h->read_size = h->read_cur = 1024;
+  h->read_max = 1 << 20;
+  memset (&h->stats, 0, sizeof h->stats);
+  h->match_context = NULL;
+  h->record_fp = NULL;
+  h->record_t0 = 0;
   h->pcre_error = 0;
-  h->buffer = NULL;
+  h->base = h->buffer = NULL;
   h->len = h->alloc = 0;
-  h->next_match = -1;
+  h->match_start = h->next_match = -1;
+  h->resume = 0;
+  h->keep_buffer = 0;
   h->debug_fp = NULL;
   h->user1 = h->user2 = h->user3 = NULL;
 
@@ -74,10 +111,11 @@ static exp_h * create_handle (void) {
 
 
 static void clear_buffer (exp_h *h) {
-  exp_free (h->buffer);
-  h->buffer = NULL;
+  a_free (h->allocator, h->base);
+  h->base = h->buffer = NULL;
   h->alloc = h->len = 0;
-  h->next_match = -1;
+  h->match_start = h->next_match = -1;
+  h->resume = 0;
 }
 
 
@@ -93,7 +131,7 @@ void exp_init (void *(*private_malloc)(size_t),
 int exp_close (exp_h *h) {
   int status = 0;
 
-  exp_free (h->buffer);
+  a_free (h->allocator, h->base);
 
   if (h->fd >= 0)
     close (h->fd);
@@ -102,7 +140,7 @@ int exp_close (exp_h *h) {
       return -1;
   }
 
-  exp_free (h);
+  a_free (h->allocator, h);
 
   return status;
 }
@@ -139,14 +177,335 @@ exp_h * exp_spawnlf (unsigned flags, const char *file, const char *arg, ...) {
 }
 
 
-exp_h * exp_spawnvf (unsigned flags, const char *file, char **argv) {
+/* The slave side is a controlling tty as wide as it gets.  Strings
+ * longer than the pty row size are wrapped around, e.g " \b" is
+ * inserted at the line break, so any repl output shorter than 65535
+ * characters will not be wrapped.
+ */
+static void setup_pty (int fd, int slave_fd, unsigned flags) {
+  struct winsize wsz = { .ws_col = (unsigned short)(-1) };
+
+  if (!(flags & EXP_SPAWN_COOKED_MODE)) {
+    struct termios termios;
+
+    /* Set raw mode. */
+    tcgetattr (slave_fd, &termios);
+    cfmakeraw (&termios);
+    tcsetattr (slave_fd, TCSANOW, &termios);
+  }
+
+  ioctl (fd, TIOCSWINSZ, &wsz);
+}
+
+
+/* Close every fd from 3 up.  close_range does it in one syscall, the
+ * loop is for kernels older than 5.9, or when asked for with
+ * EXP_SPAWN_CLOSE_LOOP.
+ */
+static void close_fds_from_3 (unsigned flags) {
+  int i, max_fd;
+
+#ifdef SYS_close_range
+  if (!(flags & EXP_SPAWN_CLOSE_LOOP) &&
+      syscall (SYS_close_range, 3, ~0U, 0) == 0)
+    return;
+#endif
+  max_fd = sysconf (_SC_OPEN_MAX);
+  if (max_fd == -1)
+    max_fd = 1024;
+  if (max_fd > 65536)
+    max_fd = 65536;      /* bound the amount of work we do here */
+  for (i = 3; i < max_fd; ++i)
+    close (i);
+}
+
+
+/* posix_spawn_file_actions_addclosefrom_np is glibc 2.34 and later. */
+#if defined (POSIX_SPAWN_SETSID) && defined (__GLIBC_PREREQ)
+#if __GLIBC_PREREQ (2, 34)
+#define EXP_HAVE_POSIX_SPAWN 1
+#endif
+#endif
+
+#ifdef EXP_HAVE_POSIX_SPAWN
+
+/* posix_spawn shares the parent's memory until exec (clone with
+ * CLONE_VM | CLONE_VFORK in glibc), so its cost does not grow with the
+ * parent heap, and it reports exec failures to the parent.  Everything
+ * that can be done to the pty from the parent is, the child only
+ * becomes a session leader, opens the slave as its controlling tty and
+ * drops inherited fds and signal handlers.
+ */
+static pid_t spawn_posix (unsigned flags, int fd, const char *slave,
+                          const char *file, char **argv) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t set;
+  short spawn_flags = POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK;
+  int slave_fd, err;
+  pid_t pid = -1;
+
+  /* Open the slave here only to set it up. */
+  slave_fd = open (slave, O_RDWR|O_NOCTTY|O_CLOEXEC);
+  if (slave_fd == -1)
+    return -1;
+  setup_pty (fd, slave_fd, flags);
+
+  posix_spawn_file_actions_init (&actions);
+  posix_spawnattr_init (&attr);
+
+  /* Opened after setsid, the slave becomes our controlling tty. */
+  posix_spawn_file_actions_addopen (&actions, 0, slave, O_RDWR, 0);
+  posix_spawn_file_actions_adddup2 (&actions, 0, 1);
+  posix_spawn_file_actions_adddup2 (&actions, 0, 2);
+  if (!(flags & EXP_SPAWN_KEEP_FDS))
+    posix_spawn_file_actions_addclosefrom_np (&actions, 3);
+  else
+    posix_spawn_file_actions_addclose (&actions, fd);
+
+  sigemptyset (&set);
+  posix_spawnattr_setsigmask (&attr, &set);
+  if (!(flags & EXP_SPAWN_KEEP_SIGNALS)) {
+    /* Remove all signal handlers, without the race the fork path has. */
+    sigfillset (&set);
+    posix_spawnattr_setsigdefault (&attr, &set);
+    spawn_flags |= POSIX_SPAWN_SETSIGDEF;
+  }
+  posix_spawnattr_setflags (&attr, spawn_flags);
+
+  err = posix_spawnp (&pid, file, &actions, &attr, argv, environ);
+
+  posix_spawnattr_destroy (&attr);
+  posix_spawn_file_actions_destroy (&actions);
+  close (slave_fd);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  return pid;
+}
+#endif
+
+
+/* Write all n bytes, or read exactly n bytes. */
+static int write_full (int fd, const char *p, size_t n) {
+  ssize_t r;
+  for (; n > 0; n -= r, p += r)
+    if ((r = write (fd, p, n)) <= 0)
+      return -1;
+  return 0;
+}
+
+static int read_full (int fd, char *p, size_t n) {
+  ssize_t r;
+  for (; n > 0; n -= r, p += r)
+    if ((r = read (fd, p, n)) <= 0)
+      return -1;
+  return 0;
+}
+
+
+/* Monotonic time in ns, for the stats. */
+static uint64_t now_ns (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* Append one record to the transcript. */
+static void record (exp_h *h, char dir, const char *p, size_t n) {
+  struct timespec ts;
+  int64_t t;
+  size_t i;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  t = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  if (h->record_t0 == 0)
+    h->record_t0 = t;
+
+  fprintf (h->record_fp, "%c %" PRId64 " %zu\n", dir, t - h->record_t0, n);
+  if (p != NULL)
+    fwrite (p, 1, n, h->record_fp);
+  else
+    for (i = 0; i < n; ++i)
+      fputc ('*', h->record_fp);
+  fputc ('\n', h->record_fp);
+}
+
+
+/* Read a whole transcript into memory.  This runs in the parent
+ * before forking, so the child that serves it only reads and writes
+ * fds, the parent may have other threads holding the stdio and malloc
+ * locks at the time of the fork.
+ */
+static char *load_transcript (const struct exp_allocator *a,
+                              const char *path, size_t *size) {
+  struct stat st;
+  char *buf = NULL;
+  int fd, err;
+
+  fd = open (path, O_RDONLY|O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  if (fstat (fd, &st) == -1)
+    goto error;
+  buf = a_malloc (a, st.st_size + 1);
+  if (buf == NULL)
+    goto error;
+  if (st.st_size > 0 && read_full (fd, buf, st.st_size) == -1)
+    goto error;
+  close (fd);
+  *size = st.st_size;
+  return buf;
+
+ error:
+  err = errno;
+  if (buf != NULL)
+    a_free (a, buf);
+  close (fd);
+  errno = err;
+  return NULL;
+}
+
+
+/* Parse the decimal number at p, or return NULL if there is none. */
+static char *scan_number (char *p, const char *end, uint64_t *n) {
+  if (p == end || *p < '0' || *p > '9')
+    return NULL;
+  for (*n = 0; p < end && *p >= '0' && *p <= '9'; ++p)
+    *n = *n * 10 + (*p - '0');
+  return p;
+}
+
+
+/* Serve a transcript loaded by load_transcript on stdin and stdout,
+ * see exp_spawn_replay.  This runs in the forked child, so it sticks
+ * to async-signal-safe calls.  What is waited for is read over the
+ * bytes already served.
+ */
+static int serve_transcript (unsigned flags, char *p, size_t size) {
+  const char *end = p + size;
+  uint64_t t, n, prev = 0;
+  struct timespec ts;
+  char dir;
+
+  while (end - p >= 2 && (p[0] == 'R' || p[0] == 'W') && p[1] == ' ') {
+    dir = p[0];
+    p = scan_number (p + 2, end, &t);
+    if (p == NULL || p == end || *p++ != ' ')
+      break;
+    p = scan_number (p, end, &n);
+    if (p == NULL || p == end || *p++ != '\n' || n > (uint64_t) (end - p))
+      break;
+
+    if (!(flags & EXP_SPAWN_REPLAY_FAST) && t > prev) {
+      ts.tv_sec = (t - prev) / 1000000;
+      ts.tv_nsec = (t - prev) % 1000000 * 1000;
+      nanosleep (&ts, NULL);
+    }
+    prev = t;
+
+    /* What we wrote is waited for, what we read is sent. */
+    if ((dir == 'W' ? read_full (0, p, n) : write_full (1, p, n)) == -1)
+      break;
+    p += n;
+    if (p < end && *p == '\n')
+      ++p;
+  }
+  return EXIT_SUCCESS;
+}
+
+
+/* A NULL argv serves the transcript `script` of `size` bytes instead. */
+static pid_t spawn_fork (unsigned flags, int fd, const char *slave,
+                         const char *file, char **argv,
+                         char *script, size_t size) {
+  pid_t pid = fork ();
+  if (pid != 0)
+    return pid;
+
+  /* Child. */
+  int slave_fd;
+
+  if (!(flags & EXP_SPAWN_KEEP_SIGNALS)) {
+    struct sigaction sa;
+    int i;
+
+    /* Remove all signal handlers.  See the justification here:
+     * https://www.redhat.com/archives/libvir-list/2008-August/msg00303.html
+     * We don't mask signal handlers yet, so this isn't completely
+     * race-free, but better than not doing it at all.
+     */
+    memset (&sa, 0, sizeof sa);
+    sa.sa_handler = SIG_DFL;
+    sa.sa_flags = 0;
+    sigemptyset (&sa.sa_mask);
+    for (i = 1; i < NSIG; ++i)
+      sigaction (i, &sa, NULL);
+  }
+
+  setsid ();
+
+  /* Open the slave side of the pty.  We must do this in the child
+   * after setsid so it becomes our controlling tty.
+   */
+  slave_fd = open (slave, O_RDWR);
+  if (slave_fd == -1)
+    _exit (EXIT_FAILURE);
+
+  setup_pty (fd, slave_fd, flags);
+
+  /* Set up stdin, stdout, stderr to point to the pty. */
+  dup2 (slave_fd, 0);
+  dup2 (slave_fd, 1);
+  dup2 (slave_fd, 2);
+  close (slave_fd);
+
+  /* Close the master side of the pty - do this late to avoid a
+   * kernel bug, see sshpass source code.
+   */
+  close (fd);
+
+  /* Close all other file descriptors.  This ensures that we don't
+   * hold open (eg) pipes from the parent process.
+   */
+  if (!(flags & EXP_SPAWN_KEEP_FDS))
+    close_fds_from_3 (flags);
+
+  if (argv == NULL)
+    _exit (serve_transcript (flags, script, size));
+
+  /* Run the subprocess. */
+  execvp (file, argv);
+  perror (file);
+  _exit (EXIT_FAILURE);
+}
+
+
+static exp_h * spawn (const struct exp_allocator *a, unsigned flags,
+                      const char *file, char **argv) {
   exp_h *h = NULL;
   int fd = -1;
   int err;
   char slave[1024];
+  char *script = NULL;
+  size_t size = 0;
   pid_t pid = 0;
 
-  fd = posix_openpt (O_RDWR|O_NOCTTY);
+  if (a == NULL)
+    a = &default_allocator;
+
+  if (argv == NULL) {
+    script = load_transcript (a, file, &size);
+    if (script == NULL)
+      goto error;
+  }
+
+  /* The master must not leak into the child, or into anything else
+   * the parent spawns.
+   */
+  fd = posix_openpt (O_RDWR|O_NOCTTY|O_CLOEXEC);
   if (fd == -1)
     goto error;
 
@@ -160,103 +519,31 @@ exp_h * exp_spawnvf (unsigned flags, const char *file, char **argv) {
   if (ptsname_r (fd, slave, sizeof slave) != 0)
     goto error;
 
-  /* Create the handle last before we fork. */
-  h = create_handle ();
+  /* Create the handle last before we spawn. */
+  h = create_handle (a);
   if (h == NULL)
     goto error;
 
-  pid = fork ();
+#ifdef EXP_HAVE_POSIX_SPAWN
+  if (argv != NULL &&
+      !(flags & (EXP_SPAWN_USE_FORK | EXP_SPAWN_CLOSE_LOOP)))
+    pid = spawn_posix (flags, fd, slave, file, argv);
+  else
+#endif
+    pid = spawn_fork (flags, fd, slave, file, argv, script, size);
   if (pid == -1)
     goto error;
 
-  if (pid == 0) {               /* Child. */
-    int slave_fd;
-
-    if (!(flags & EXP_SPAWN_KEEP_SIGNALS)) {
-      struct sigaction sa;
-      int i;
-
-      /* Remove all signal handlers.  See the justification here:
-       * https://www.redhat.com/archives/libvir-list/2008-August/msg00303.html
-       * We don't mask signal handlers yet, so this isn't completely
-       * race-free, but better than not doing it at all.
-       */
-      memset (&sa, 0, sizeof sa);
-      sa.sa_handler = SIG_DFL;
-      sa.sa_flags = 0;
-      sigemptyset (&sa.sa_mask);
-      for (i = 1; i < NSIG; ++i)
-        sigaction (i, &sa, NULL);
-    }
-
-    setsid ();
-
-    /* Open the slave side of the pty.  We must do this in the child
-     * after setsid so it becomes our controlling tty.
-     */
-    slave_fd = open (slave, O_RDWR);
-    if (slave_fd == -1)
-      goto error;
-
-    if (!(flags & EXP_SPAWN_COOKED_MODE)) {
-      struct termios termios;
-
-      /* Set raw mode. */
-      tcgetattr (slave_fd, &termios);
-      cfmakeraw (&termios);
-      tcsetattr (slave_fd, TCSANOW, &termios);
-    }
-
-    /* String longer than the pty row size will be wraped around. e.g
-     * " \b" will be inserted at the end of the line break.
-     * We set the window row to maximum size to avoid this issue. Any
-     * repl output that's shorter than 65535 characters will not be wrapped
-     * around.
-     */
-    struct winsize wsz;
-    wsz.ws_col = (unsigned short)(-1);
-    ioctl(fd, TIOCSWINSZ, &wsz);
-
-    /* Set up stdin, stdout, stderr to point to the pty. */
-    dup2 (slave_fd, 0);
-    dup2 (slave_fd, 1);
-    dup2 (slave_fd, 2);
-    close (slave_fd);
-
-    /* Close the master side of the pty - do this late to avoid a
-     * kernel bug, see sshpass source code.
-     */
-    close (fd);
-
-    if (!(flags & EXP_SPAWN_KEEP_FDS)) {
-      int i, max_fd;
-
-      /* Close all other file descriptors.  This ensures that we don't
-       * hold open (eg) pipes from the parent process.
-       */
-      max_fd = sysconf (_SC_OPEN_MAX);
-      if (max_fd == -1)
-        max_fd = 1024;
-      if (max_fd > 65536)
-        max_fd = 65536;      /* bound the amount of work we do here */
-      for (i = 3; i < max_fd; ++i)
-        close (i);
-    }
-
-    /* Run the subprocess. */
-    execvp (file, argv);
-    perror (file);
-    _exit (EXIT_FAILURE);
-  }
-
-  /* Parent. */
-
+  if (script != NULL)
+    a_free (a, script);
   h->fd = fd;
   h->pid = pid;
   return h;
 
  error:
   err = errno;
+  if (script != NULL)
+    a_free (a, script);
   if (fd >= 0)
     close (fd);
   if (pid > 0)
@@ -268,28 +555,425 @@ exp_h * exp_spawnvf (unsigned flags, const char *file, char **argv) {
 }
 
 
-int exp_expect (exp_h *h, const exp_regexp *regexps, pcre2_match_data *match_data) {
-  time_t start_t, now_t;
-  int timeout;
-  struct pollfd pfds[1];
+exp_h * exp_spawnvf (unsigned flags, const char *file, char **argv) {
+  return spawn (NULL, flags, file, argv);
+}
+
+
+exp_h * exp_spawnvf_alloc (const struct exp_allocator *a, unsigned flags,
+                           const char *file, char **argv) {
+  return spawn (a, flags, file, argv);
+}
+
+
+exp_h * exp_spawn_replay (unsigned flags, const char *transcript) {
+  return spawn (NULL, flags, transcript, NULL);
+}
+
+
+exp_h * exp_spawn_replay_alloc (const struct exp_allocator *a,
+                                unsigned flags, const char *transcript) {
+  return spawn (a, flags, transcript, NULL);
+}
+
+
+#if defined (__x86_64__) && defined (__GNUC__)
+#include <immintrin.h>
+#define EXP_MEMMEM_X86 1
+#endif
+
+
+/* Portable fallback: memchr for the first byte, then memcmp. */
+static const char *
+memmem_scalar (const char *s, size_t n, const char *nd, size_t m)
+{
+  const char *end = s + n - m + 1;
+  const char *p;
+
+  for (p = s; p < end; ++p) {
+    p = memchr (p, nd[0], end - p);
+    if (p == NULL)
+      return NULL;
+    if (memcmp (p, nd, m) == 0)
+      return p;
+  }
+  return NULL;
+}
+
+#ifdef EXP_MEMMEM_X86
+/* Compare the first and the last byte of the needle against a whole
+ * vector of positions at once, and memcmp only where both agree.  For
+ * a short needle that is rare in the haystack, like a prompt, almost
+ * every block is rejected by the two compares alone.
+ */
+static const char *
+memmem_sse2 (const char *s, size_t n, const char *nd, size_t m)
+{
+  const __m128i first = _mm_set1_epi8 (nd[0]);
+  const __m128i last = _mm_set1_epi8 (nd[m - 1]);
+  size_t i;
+
+  for (i = 0; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128 ((const __m128i *) (s + i));
+    __m128i b = _mm_loadu_si128 ((const __m128i *) (s + i + m - 1));
+    unsigned mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (a, first),
+                                                      _mm_cmpeq_epi8 (b, last)));
+    while (mask) {
+      size_t k = i + __builtin_ctz (mask);
+      if (memcmp (s + k, nd, m) == 0)
+        return s + k;
+      mask &= mask - 1;
+    }
+  }
+  return memmem_scalar (s + i, n - i, nd, m);
+}
+
+__attribute__ ((target ("avx2")))
+static const char *
+memmem_avx2 (const char *s, size_t n, const char *nd, size_t m)
+{
+  const __m256i first = _mm256_set1_epi8 (nd[0]);
+  const __m256i last = _mm256_set1_epi8 (nd[m - 1]);
+  size_t i;
+
+  for (i = 0; i + m - 1 + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256 ((const __m256i *) (s + i));
+    __m256i b = _mm256_loadu_si256 ((const __m256i *) (s + i + m - 1));
+    uint32_t mask = _mm256_movemask_epi8 (_mm256_and_si256 (_mm256_cmpeq_epi8 (a, first),
+                                                            _mm256_cmpeq_epi8 (b, last)));
+    while (mask) {
+      size_t k = i + __builtin_ctz (mask);
+      if (memcmp (s + k, nd, m) == 0)
+        return s + k;
+      mask &= mask - 1;
+    }
+  }
+  return memmem_sse2 (s + i, n - i, nd, m);
+}
+#endif
+
+const char *
+exp_memmem (const char *s, size_t n, const char *nd, size_t m)
+{
+  if (m == 0)
+    return s;
+  if (n < m)
+    return NULL;
+#ifdef EXP_MEMMEM_X86
+  if (__builtin_cpu_supports ("avx2"))
+    return memmem_avx2 (s, n, nd, m);
+  return memmem_sse2 (s, n, nd, m);
+#else
+  return memmem_scalar (s, n, nd, m);
+#endif
+}
+
+
+/* Length of the longest tail of s[0 .. n) that is a proper prefix of
+ * the needle, which is where a needle split across reads starts.
+ */
+static size_t
+needle_partial (const char *s, size_t n, const char *nd, size_t m)
+{
+  size_t k = m - 1 < n ? m - 1 : n;
+
+  for (; k > 0; --k)
+    if (memcmp (s + n - k, nd, k) == 0)
+      return k;
+  return 0;
+}
+
+
+static inline size_t
+needle_length (const exp_regexp *rx)
+{
+  return rx->needle_len ? rx->needle_len : strlen (rx->needle);
+}
+
+/* Match a literal needle from h->resume.  Returns 1 on a match, 0 on
+ * a partial match at the end of the buffer and -1 otherwise.  *start
+ * is set to where the (partial) match begins.
+ */
+static int
+match_needle (exp_h *h, const exp_regexp *rx, size_t *start)
+{
+  const size_t m = needle_length (rx);
+  const char *s = h->buffer + h->resume;
+  const size_t n = h->len - h->resume;
+  const char *p = exp_memmem (s, n, rx->needle, m);
+  size_t k;
+
+  if (p != NULL) {
+    *start = p - h->buffer;
+    return 1;
+  }
+  k = m > 0 ? needle_partial (s, n, rx->needle, m) : 0;
+  *start = h->len - k;
+  return k > 0 ? 0 : -1;
+}
+
+
+/* See if there is a full or partial match against any regexp in the
+ * buffer.  Returns the matching regexp's r, or EXP_AGAIN if more data
+ * is needed.
+ */
+static int match_buffer (exp_h *h, const exp_regexp *regexps,
+                         pcre2_match_data *match_data) {
   int r;
-  ssize_t rs;
 
-  time (&start_t);
+  /* See if there is a full or partial match against any regexp. */
+  if (regexps) {
+    size_t i;
+    int can_clear_buffer = 1;
+    size_t resume = h->len;
+
+    assert (h->buffer != NULL);
+
+    for (i = 0; regexps[i].r > 0; ++i) {
+      const int options = regexps[i].options | PCRE2_PARTIAL_SOFT;
+      size_t start;
+
+      if (regexps[i].re == NULL) {
+        r = match_needle (h, &regexps[i], &start);
+        if (r > 0) {
+          h->match_start = start;
+          h->next_match = start + needle_length (&regexps[i]);
+          if (h->debug_fp)
+            fprintf (h->debug_fp, "DEBUG: next_match at buffer offset %zu\n",
+                     h->next_match);
+          return regexps[i].r;
+        }
+        if (r == 0)
+          can_clear_buffer = 0;
+        if (start < resume)
+          resume = start;
+        continue;
+      }
+
+      r = pcre2_match (regexps[i].re,
+                       (PCRE2_SPTR) h->buffer, (int)h->len, h->resume,
+                       options, match_data, h->match_context);
+      h->pcre_error = r;
+
+      if (r >= 0) {
+        /* A full match. */
+        const PCRE2_SIZE *ovector = NULL;
+
+        if (match_data)
+          ovector = pcre2_get_ovector_pointer (match_data);
+
+        if (ovector != NULL && ovector[1] != ~(PCRE2_SIZE)0) {
+          h->match_start = ovector[0];
+          h->next_match = ovector[1];
+        }
+        else
+          h->match_start = h->next_match = -1;
+        if (h->debug_fp)
+          fprintf (h->debug_fp, "DEBUG: next_match at buffer offset %zu\n",
+                   h->next_match);
+        return regexps[i].r;
+      }
+
+      else if (r == PCRE2_ERROR_NOMATCH) {
+        /* No match at all.  No match can start before the end of
+         * what we have, more data can't change that.
+         */
+        start = h->len;
+      }
+
+      else if (r == PCRE2_ERROR_PARTIAL) {
+        /* Partial match.  Keep the buffer and keep reading, the
+         * next attempt resumes where the partial match started.
+         */
+        can_clear_buffer = 0;
+        if (match_data)
+          start = pcre2_get_ovector_pointer (match_data)[0];
+        else
+          start = h->resume;
+      }
+
+      else {
+        /* An actual PCRE error. */
+        return EXP_PCRE_ERROR;
+      }
+
+      /* Lookbehinds may inspect bytes before the start offset. */
+      start -= max_lookbehind (regexps[i].re, start);
+      if (start < resume)
+        resume = start;
+    }
+
+    /* If none of the regular expressions matched (not partially)
+     * then we can clear the buffer.  This is an optimization.
+     */
+    if (can_clear_buffer && !h->keep_buffer)
+      clear_buffer (h);
+    else
+      h->resume = resume;
+
+  } /* if (regexps) */
+
+  return EXP_AGAIN;
+}
+
+
+/* match_buffer, timed for the stats. */
+static int try_match (exp_h *h, const exp_regexp *regexps,
+                      pcre2_match_data *match_data) {
+  uint64_t t0 = now_ns ();
+  int r = match_buffer (h, regexps, match_data);
+  h->stats.match_ns += now_ns () - t0;
+  return r;
+}
+
 
+/* Make room for at least n more bytes (plus the \0 terminator).  Data
+ * already consumed at the front is reclaimed once it is at least as
+ * large as what is left, otherwise the allocation grows geometrically.
+ */
+static int reserve_buffer (exp_h *h, size_t n) {
+  char *new_base;
+  size_t gap, alloc;
+
+  if (h->alloc - h->len > n)
+    return 0;
+
+  gap = h->buffer - h->base;
+  if (gap > 0 && gap >= h->len) {
+    memmove (h->base, h->buffer, h->len);
+    h->buffer = h->base;
+    h->alloc += gap;
+    gap = 0;
+    if (h->alloc - h->len > n)
+      return 0;
+  }
+
+  alloc = (gap + h->alloc) * 2;
+  if (alloc < gap + h->len + n)
+    alloc = gap + h->len + n;
+
+  /* +1 here allows us to store \0 after the data read */
+  new_base = a_realloc (h->allocator, h->base, alloc + 1);
+  if (new_base == NULL)
+    return -1;
+  h->base = new_base;
+  h->buffer = new_base + gap;
+  h->alloc = alloc - gap;
+  return 0;
+}
+
+
+/* Start waiting for regexps.  Leftover data from a previous match is
+ * matched first; if it already matches, that result is returned,
+ * otherwise EXP_AGAIN.
+ */
+int exp_expect_start (exp_h *h, const exp_regexp *regexps,
+                      pcre2_match_data *match_data) {
   if (h->next_match == -1) {
     /* Fully clear the buffer, then read. */
     clear_buffer (h);
-  } else {
-    /* See the comment in the manual about h->next_match.  We have
-     * some data remaining in the buffer, so begin by matching that.
+    return EXP_AGAIN;
+  }
+
+  /* See the comment in the manual about h->next_match.  We have
+   * some data remaining in the buffer, so begin by matching that.
+   * Skipping the consumed part is O(1), it is reclaimed when the
+   * buffer next needs room.  The \0 after the data is still there.
+   */
+  h->buffer += h->next_match;
+  h->len -= h->next_match;
+  h->alloc -= h->next_match;
+  h->match_start = h->next_match = -1;
+  h->resume = 0;
+  return try_match (h, regexps, match_data);
+}
+
+
+/* Read once from the pty, which must be readable, and match.  Returns
+ * the matching regexp's r, EXP_AGAIN if there is no match yet, or
+ * EXP_EOF / EXP_ERROR.
+ */
+int exp_expect_read (exp_h *h, const exp_regexp *regexps,
+                     pcre2_match_data *match_data) {
+  ssize_t rs;
+  size_t want;
+  int n;
+  size_t len = h->len;
+  uint64_t t0 = now_ns ();
+
+  /* We expect there is something to read from the file descriptor.
+   * Read into all the room there is, growing the read size while reads
+   * come back large, and drain whatever else is already queued before
+   * matching.  A pty hands out at most 4096 bytes per read in raw
+   * mode, so draining is what saves polls and match attempts.
+   */
+  for (want = h->read_cur;;) {
+    if (reserve_buffer (h, want) == -1)
+      return EXP_ERROR;
+
+    rs = read (h->fd, h->buffer + h->len, h->alloc - h->len);
+    h->stats.nsyscall++;
+    h->stats.nread++;
+    if (rs <= 0)
+      break;
+
+    if (h->record_fp)
+      record (h, 'R', h->buffer + h->len, rs);
+    h->len += rs;
+    h->stats.bytes_read += rs;
+    if ((size_t) rs >= h->read_cur && h->read_cur < h->read_max)
+      h->read_cur = h->read_cur * 2 < h->read_max ? h->read_cur * 2 : h->read_max;
+
+    h->stats.nsyscall++;
+    if (ioctl (h->fd, FIONREAD, &n) == -1 || n <= 0)
+      break;
+    want = n > h->read_cur ? n : h->read_cur;
+  }
+  h->stats.read_ns += now_ns () - t0;
+
+  if (h->debug_fp)
+    fprintf (h->debug_fp, "DEBUG: read returned %zd\n", rs);
+  if (h->len > len) {
+    /* Got data before the pty closed, match it first. */
+    rs = h->len - len;
+  }
+  else if (rs == -1) {
+    /* Annoyingly on Linux (I'm fairly sure this is a bug) if the
+     * writer closes the connection, the entire pty is destroyed,
+     * and read returns -1 / EIO.  Handle that special case here.
      */
-    memmove (&h->buffer[0], &h->buffer[h->next_match], h->len - h->next_match);
-    h->len -= h->next_match;
-    h->buffer[h->len] = '\0';
-    h->next_match = -1;
-    goto try_match;
+    if (errno == EIO)
+      return EXP_EOF;
+
+    return EXP_ERROR;
   }
+  else if (rs == 0)
+    return EXP_EOF;
+
+  /* We read something. */
+  h->buffer[h->len] = '\0';
+  if (h->debug_fp) {
+    fprintf (h->debug_fp, "DEBUG: read %zd bytes from pty\n", rs);
+    fprintf (h->debug_fp, "DEBUG: buffer content: ");
+    debug_buffer (h->debug_fp, h->buffer);
+    fprintf (h->debug_fp, "\n");
+  }
+
+  return try_match (h, regexps, match_data);
+}
+
+
+int exp_expect (exp_h *h, const exp_regexp *regexps, pcre2_match_data *match_data) {
+  time_t start_t, now_t;
+  int timeout;
+  struct pollfd pfds[1];
+  int r;
+
+  time (&start_t);
+
+  r = exp_expect_start (h, regexps, match_data);
+  if (r != EXP_AGAIN)
+    return r;
 
   for (;;) {
     /* If we've got a timeout then work out how many seconds are left.
@@ -309,6 +993,8 @@ int exp_expect (exp_h *h, const exp_regexp *regexps, pcre2_match_data *match_dat
     pfds[0].events = POLLIN;
     pfds[0].revents = 0;
     r = poll (pfds, 1, timeout);
+    h->stats.nsyscall++;
+    h->stats.npoll++;
     if (h->debug_fp)
       fprintf (h->debug_fp, "DEBUG: poll returned %d\n", r);
     if (r == -1) {
@@ -318,102 +1004,183 @@ int exp_expect (exp_h *h, const exp_regexp *regexps, pcre2_match_data *match_dat
     if (r == 0)
       return EXP_TIMEOUT;
 
-    /* Otherwise we expect there is something to read from the file
-     * descriptor.
-     */
-    if (h->alloc - h->len <= h->read_size) {
-      char *new_buffer;
-      /* +1 here allows us to store \0 after the data read */
-      new_buffer = exp_realloc (h->buffer, h->alloc + h->read_size + 1);
-      if (new_buffer == NULL) {
-        return EXP_ERROR;
-      }
-      h->buffer = new_buffer;
-      h->alloc += h->read_size;
-    }
-    rs = read (h->fd, h->buffer + h->len, h->read_size);
+    r = exp_expect_read (h, regexps, match_data);
+    if (r != EXP_AGAIN)
+      return r;
+  }
+}
 
-    if (h->debug_fp)
-      fprintf (h->debug_fp, "DEBUG: read returned %zd\n", rs);
-    if (rs == -1) {
-      /* Annoyingly on Linux (I'm fairly sure this is a bug) if the
-       * writer closes the connection, the entire pty is destroyed,
-       * and read returns -1 / EIO.  Handle that special case here.
-       */
-      if (errno == EIO)
-        return EXP_EOF;
 
-      return EXP_ERROR;
-    }
-    if (rs == 0)
-      return EXP_EOF;
+/* One handle waited on by a mux. */
+struct exp_mux_entry {
+  exp_h *h;
+  const exp_regexp *regexps;
+  pcre2_match_data *match_data;
+  int result;                   /* EXP_AGAIN while still waiting */
+};
+
+struct exp_mux {
+  const struct exp_allocator *allocator;
+  int epfd;
+  size_t n;
+  size_t alloc;
+  struct exp_mux_entry **ents;
+};
 
-    /* We read something. */
-    h->len += rs;
-    h->buffer[h->len] = '\0';
-    if (h->debug_fp) {
-      fprintf (h->debug_fp, "DEBUG: read %zd bytes from pty\n", rs);
-      fprintf (h->debug_fp, "DEBUG: buffer content: ");
-      debug_buffer (h->debug_fp, h->buffer);
-      fprintf (h->debug_fp, "\n");
+
+exp_mux * exp_mux_new (void) {
+  return exp_mux_new_alloc (NULL);
+}
+
+
+exp_mux * exp_mux_new_alloc (const struct exp_allocator *a) {
+  exp_mux *m;
+
+  if (a == NULL)
+    a = &default_allocator;
+  m = a_malloc (a, sizeof *m);
+  if (m == NULL)
+    return NULL;
+
+  m->allocator = a;
+  m->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (m->epfd == -1) {
+    a_free (a, m);
+    return NULL;
+  }
+  m->n = m->alloc = 0;
+  m->ents = NULL;
+  return m;
+}
+
+
+void exp_mux_free (exp_mux *m) {
+  size_t i;
+
+  for (i = 0; i < m->n; ++i)
+    a_free (m->allocator, m->ents[i]);
+  a_free (m->allocator, m->ents);
+  close (m->epfd);
+  a_free (m->allocator, m);
+}
+
+
+static ssize_t mux_find (exp_mux *m, exp_h *h) {
+  size_t i;
+
+  for (i = 0; i < m->n; ++i)
+    if (m->ents[i]->h == h)
+      return i;
+  return -1;
+}
+
+
+/* Start waiting for regexps on h.  If h is already in the mux, it
+ * waits for the new regexps instead.  The regexps and match data must
+ * stay valid until h is reported or removed.
+ */
+int exp_mux_add (exp_mux *m, exp_h *h, const exp_regexp *regexps,
+                 pcre2_match_data *match_data) {
+  struct exp_mux_entry *e;
+  ssize_t i = mux_find (m, h);
+
+  if (i >= 0)
+    e = m->ents[i];
+  else {
+    struct epoll_event ev;
+
+    if (m->n == m->alloc) {
+      size_t alloc = m->alloc ? m->alloc * 2 : 8;
+      struct exp_mux_entry **ents;
+
+      ents = a_realloc (m->allocator, m->ents, alloc * sizeof *ents);
+      if (ents == NULL)
+        return -1;
+      m->ents = ents;
+      m->alloc = alloc;
     }
 
-  try_match:
-    /* See if there is a full or partial match against any regexp. */
-    if (regexps) {
-      size_t i;
-      int can_clear_buffer = 1;
+    e = a_malloc (m->allocator, sizeof *e);
+    if (e == NULL)
+      return -1;
 
-      assert (h->buffer != NULL);
+    ev.events = EPOLLIN;
+    ev.data.ptr = e;
+    if (epoll_ctl (m->epfd, EPOLL_CTL_ADD, h->fd, &ev) == -1) {
+      a_free (m->allocator, e);
+      return -1;
+    }
+    m->ents[m->n++] = e;
+  }
 
-      for (i = 0; regexps[i].r > 0; ++i) {
-        const int options = regexps[i].options | PCRE2_PARTIAL_SOFT;
+  e->h = h;
+  e->regexps = regexps;
+  e->match_data = match_data;
+  e->result = exp_expect_start (h, regexps, match_data);
+  return 0;
+}
 
-        r = pcre2_match (regexps[i].re,
-                         (PCRE2_SPTR) h->buffer, (int)h->len, 0,
-                         options, match_data, NULL);
-        h->pcre_error = r;
 
-        if (r >= 0) {
-          /* A full match. */
-          const PCRE2_SIZE *ovector = NULL;
+int exp_mux_remove (exp_mux *m, exp_h *h) {
+  ssize_t i = mux_find (m, h);
 
-          if (match_data)
-            ovector = pcre2_get_ovector_pointer (match_data);
+  if (i == -1) {
+    errno = ENOENT;
+    return -1;
+  }
 
-          if (ovector != NULL && ovector[1] != ~(PCRE2_SIZE)0)
-            h->next_match = ovector[1];
-          else
-            h->next_match = -1;
-          if (h->debug_fp)
-            fprintf (h->debug_fp, "DEBUG: next_match at buffer offset %zu\n",
-                     h->next_match);
-          return regexps[i].r;
-        }
+  epoll_ctl (m->epfd, EPOLL_CTL_DEL, h->fd, NULL);
+  a_free (m->allocator, m->ents[i]);
+  m->ents[i] = m->ents[--m->n];
+  return 0;
+}
 
-        else if (r == PCRE2_ERROR_NOMATCH) {
-          /* No match at all. */
-          /* (nothing here) */
-        }
 
-        else if (r == PCRE2_ERROR_PARTIAL) {
-          /* Partial match.  Keep the buffer and keep reading. */
-          can_clear_buffer = 0;
-        }
+/* Wait until any handle in the mux matches one of its regexps, hits
+ * EOF or fails.  *which is set to that handle, which is removed from
+ * the mux, and the result is returned as exp_expect would.  Returns
+ * EXP_TIMEOUT with *which set to NULL if no handle made progress for
+ * timeout_ms (-1 waits forever).
+ */
+int exp_mux_wait (exp_mux *m, int timeout_ms, exp_h **which) {
+  struct epoll_event evs[16];
+  size_t i;
+  int n, r;
 
-        else {
-          /* An actual PCRE error. */
-          return EXP_PCRE_ERROR;
-        }
+  for (;;) {
+    /* Report a handle that already has a result. */
+    for (i = 0; i < m->n; ++i) {
+      if (m->ents[i]->result != EXP_AGAIN) {
+        r = m->ents[i]->result;
+        *which = m->ents[i]->h;
+        exp_mux_remove (m, *which);
+        return r;
       }
+    }
 
-      /* If none of the regular expressions matched (not partially)
-       * then we can clear the buffer.  This is an optimization.
-       */
-      if (can_clear_buffer)
-        clear_buffer (h);
+    *which = NULL;
+    if (m->n == 0) {
+      errno = ENOENT;
+      return EXP_ERROR;
+    }
 
-    } /* if (regexps) */
+    n = epoll_wait (m->epfd, evs, sizeof evs / sizeof evs[0], timeout_ms);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return EXP_ERROR;
+    }
+
+    if (n == 0)
+      return EXP_TIMEOUT;
+
+    for (i = 0; i < (size_t) n; ++i) {
+      struct exp_mux_entry *e = evs[i].data.ptr;
+
+      e->h->stats.npoll++;
+      if (e->result == EXP_AGAIN)
+        e->result = exp_expect_read (e->h, e->regexps, e->match_data);
+    }
   }
 }
 
@@ -448,15 +1215,21 @@ static int exp_vprintf (exp_h *h, int password, const char *fs, va_list args) {
   p = msg;
   while (n > 0) {
     r = write (h->fd, p, n);
+    h->stats.nsyscall++;
+    h->stats.nwrite++;
     if (r == -1) {
-      exp_free (msg);
+      free (msg);
       return -1;
     }
+    if (h->record_fp)
+      record (h, 'W', password ? NULL : p, r);
     n -= r;
     p += r;
+    h->stats.bytes_written += r;
   }
 
-  exp_free (msg);
+  /* msg comes from vasprintf, not from the private allocator. */
+  free (msg);
   return len;
 }
 
@@ -484,7 +1257,10 @@ int exp_printf_password (exp_h *h, const char *fs, ...) {
 
 
 int exp_send_interrupt (exp_h *h) {
-  return write (h->fd, "\003", 1);
+  int r = write (h->fd, "\003", 1);
+  if (r == 1 && h->record_fp)
+    record (h, 'W', "\003", 1);
+  return r;
 }
 
 
@@ -19,22 +19,59 @@
 #ifndef MINIEXPECT_H_
 #define MINIEXPECT_H_
 
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
+/* I/O counters of a handle, see exp_get_stats. */
+struct exp_stats {
+  size_t nsyscall;              /* all syscalls made on the pty */
+  size_t npoll;                 /* waits for the pty to become readable */
+  size_t nread;
+  size_t nwrite;
+  size_t bytes_read;
+  size_t bytes_written;
+  uint64_t read_ns;             /* monotonic time spent reading the pty */
+  uint64_t match_ns;            /* and matching what was read */
+};
+
+/* Allocators with a context, e.g an arena, passed to every call.  A
+ * handle or mux keeps using the allocator it was created with, which
+ * must outlive it.  NULL wherever one is taken means the allocators
+ * given to exp_init.
+ */
+struct exp_allocator {
+  void *(*malloc) (size_t size, void *data);
+  void (*free) (void *ptr, void *data);
+  void *(*realloc) (void *ptr, size_t size, void *data);
+  void *data;
+};
+
 /* This handle is created per subprocess that is spawned. */
 struct exp_h {
   int     fd;
   pid_t   pid;
   int     timeout;
-  char   *buffer;
+  char   *base;         /* allocation holding the buffer */
+  char   *buffer;       /* unconsumed data, starts at or after base */
   size_t  len;
-  size_t  alloc;
+  size_t  alloc;        /* room from buffer to the end of the allocation */
+  ssize_t match_start;  /* where the last match began */
   ssize_t next_match;
-  size_t  read_size;
+  size_t  resume;       /* buffer offset the next match attempt starts at */
+  int     keep_buffer;  /* never discard unmatched data */
+  size_t  read_size;    /* initial read size */
+  size_t  read_cur;     /* current read size, adapts to the output rate */
+  size_t  read_max;
+  struct exp_stats stats;
+  const struct exp_allocator *allocator;
+  pcre2_match_context *match_context; /* passed to every match, may be NULL */
+  FILE   *record_fp;    /* transcript of every read and write, may be NULL */
+  int64_t record_t0;    /* monotonic time of the first record, in us */
   int     pcre_error;
   FILE   *debug_fp;
   void   *user1;
@@ -53,8 +90,41 @@ typedef struct exp_h exp_h;
  */
 #define exp_set_timeout(h, secs) ((h)->timeout = 1000 * (secs))
 #define exp_get_read_size(h) ((h)->read_size)
-#define exp_set_read_size(h, size) ((h)->read_size = (size))
+#define exp_set_read_size(h, size) ((h)->read_size = (h)->read_cur = (size))
+/* Reads start at read_size bytes and double, up to read_max, while
+ * the pty keeps filling them.
+ */
+#define exp_get_read_max(h) ((h)->read_max)
+#define exp_set_read_max(h, size) ((h)->read_max = (size))
+#define exp_get_stats(h) (&(h)->stats)
+#define exp_reset_stats(h) memset (&(h)->stats, 0, sizeof (h)->stats)
 #define exp_get_pcre_error(h) ((h)->pcre_error)
+/* The match context is where a JIT stack for the handle's patterns is
+ * assigned.  It is not owned by the handle.
+ */
+#define exp_get_match_context(h) ((h)->match_context)
+#define exp_set_match_context(h, mctx) ((h)->match_context = (mctx))
+/* After a match, buffer[0 .. next_match) is what the match consumed.
+ * It is a view into the handle, valid until the next expect call.
+ */
+#define exp_get_buffer(h) ((h)->buffer)
+#define exp_get_match_start(h) ((h)->match_start)
+#define exp_get_next_match(h) ((h)->next_match)
+/* Normally data that no regexp can match is thrown away.  With
+ * keep_buffer set it is kept, so everything read before a match can
+ * be collected, and matching resumes where the last attempt ended.
+ */
+#define exp_get_keep_buffer(h) ((h)->keep_buffer)
+#define exp_set_keep_buffer(h, keep) ((h)->keep_buffer = (keep))
+/* Record a transcript that exp_spawn_replay can serve back later.
+ * Each read from and write to the pty is a record:
+ *
+ *   R|W <us since the first record> <length>\n<bytes>\n
+ *
+ * Passwords are recorded as '*'.  The file is not owned by the handle.
+ */
+#define exp_set_record_file(h, fp) ((h)->record_fp = (fp))
+#define exp_get_record_file(h) ((h)->record_fp)
 #define exp_set_debug_file(h, fp) ((h)->debug_fp = (fp))
 #define exp_get_debug_file(h) ((h)->debug_fp)
 
@@ -66,6 +136,8 @@ void exp_init(void *(*private_malloc)(size_t),
 
 /* Spawn a subprocess. */
 extern exp_h *exp_spawnvf (unsigned flags, const char *file, char **argv);
+extern exp_h *exp_spawnvf_alloc (const struct exp_allocator *a, unsigned flags,
+                                 const char *file, char **argv);
 extern exp_h *exp_spawnlf (unsigned flags, const char *file, const char *arg, ...);
 #define exp_spawnv(file,argv) exp_spawnvf (0, (file), (argv))
 #define exp_spawnl(file,...) exp_spawnlf (0, (file), __VA_ARGS__)
@@ -73,16 +145,35 @@ extern exp_h *exp_spawnlf (unsigned flags, const char *file, const char *arg, ..
 #define EXP_SPAWN_KEEP_SIGNALS 1
 #define EXP_SPAWN_KEEP_FDS     2
 #define EXP_SPAWN_COOKED_MODE  4
+#define EXP_SPAWN_USE_FORK     8 /* fork/exec even where posix_spawn works */
+#define EXP_SPAWN_REPLAY_FAST 16 /* replay without the recorded delays */
+#define EXP_SPAWN_CLOSE_LOOP  32 /* fork/exec and close fds one by one */
+
+/* Spawn a stand-in that serves a recorded transcript through a pty.
+ * It waits for every recorded write, whatever the bytes are, and
+ * answers with the recorded reads, with the original delays between
+ * them unless EXP_SPAWN_REPLAY_FAST is set.  It exits at the end of
+ * the transcript.  The transcript is read in with the allocator before
+ * forking, the call fails if it cannot be read.
+ */
+extern exp_h *exp_spawn_replay (unsigned flags, const char *transcript);
+extern exp_h *exp_spawn_replay_alloc (const struct exp_allocator *a,
+                                      unsigned flags, const char *transcript);
 #define EXP_SPAWN_RAW_MODE     0
 
 /* Close the handle. */
 extern int exp_close (exp_h *h);
 
-/* Expect. */
+/* Expect.  An entry with re == NULL matches needle literally, which
+ * is much cheaper than a pattern for fixed strings like a prompt.
+ * needle_len == 0 means needle is \0 terminated.
+ */
 struct exp_regexp {
   int r;
   const pcre2_code *re;
   int options;
+  const char *needle;
+  size_t needle_len;
 };
 typedef struct exp_regexp exp_regexp;
 
@@ -91,11 +182,34 @@ enum exp_status {
   EXP_ERROR      = -1,
   EXP_PCRE_ERROR = -2,
   EXP_TIMEOUT    = -3,
+  EXP_AGAIN      = -4,          /* no match yet, more data is needed */
+  EXP_CANCELLED  = -5,          /* only from the GLib integration */
 };
 
 extern int exp_expect (exp_h *h, const exp_regexp *regexps,
                         pcre2_match_data *match_data);
 
+/* Non-blocking building blocks of exp_expect. */
+extern int exp_expect_start (exp_h *h, const exp_regexp *regexps,
+                             pcre2_match_data *match_data);
+extern int exp_expect_read (exp_h *h, const exp_regexp *regexps,
+                            pcre2_match_data *match_data);
+
+/* Find needle in s[0 .. n), vectorized where the CPU allows. */
+extern const char *exp_memmem (const char *s, size_t n,
+                               const char *needle, size_t needle_len);
+
+/* Expect on many handles at once from one thread. */
+typedef struct exp_mux exp_mux;
+
+extern exp_mux *exp_mux_new (void);
+extern exp_mux *exp_mux_new_alloc (const struct exp_allocator *a);
+extern void exp_mux_free (exp_mux *m);
+extern int exp_mux_add (exp_mux *m, exp_h *h, const exp_regexp *regexps,
+                        pcre2_match_data *match_data);
+extern int exp_mux_remove (exp_mux *m, exp_h *h);
+extern int exp_mux_wait (exp_mux *m, int timeout_ms, exp_h **which);
+
 /* Sending commands, keypresses. */
 extern int exp_printf (exp_h *h, const char *fs, ...)
   __attribute__((format(printf,2,3)));
@@ -0,0 +1,127 @@
+/* miniexpect GLib integration
+ * Copyright (C) 2024 Ailrk
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <glib-unix.h>
+
+#include "expect_glib.h"
+
+/* One pending expect.  The pty fd is polled by the source itself, the
+ * timeout is its ready time, and the cancellable is a child source, so
+ * whichever fires first dispatches it.
+ */
+struct exp_source {
+  GSource source;
+  exp_h *h;
+  const exp_regexp *regexps;
+  pcre2_match_data *match_data;
+  gpointer fd_tag;
+  GCancellable *cancellable;
+  int r;                        /* the result, EXP_AGAIN until known */
+};
+
+
+static gboolean
+exp_source_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+  struct exp_source *s = (struct exp_source *) source;
+  int r = s->r;
+
+  if (r == EXP_AGAIN) {
+    if (g_cancellable_is_cancelled (s->cancellable))
+      r = EXP_CANCELLED;
+    else if (g_source_query_unix_fd (source, s->fd_tag) != 0)
+      r = exp_expect_read (s->h, s->regexps, s->match_data);
+    else if (g_source_get_ready_time (source) != -1 &&
+             g_source_get_time (source) >= g_source_get_ready_time (source))
+      r = EXP_TIMEOUT;
+  }
+
+  if (r == EXP_AGAIN)
+    return G_SOURCE_CONTINUE;
+
+  s->r = r;
+  if (callback)
+    ((ExpAsyncFunc) callback) (s->h, r, user_data);
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+exp_source_finalize (GSource *source)
+{
+  struct exp_source *s = (struct exp_source *) source;
+
+  g_clear_object (&s->cancellable);
+}
+
+
+static GSourceFuncs exp_source_funcs = {
+  .dispatch = exp_source_dispatch,
+  .finalize = exp_source_finalize,
+};
+
+
+/* The cancellable source only has to wake the parent up. */
+static gboolean
+exp_cancelled (GCancellable *cancellable, gpointer user_data)
+{
+  return G_SOURCE_CONTINUE;
+}
+
+
+guint
+exp_expect_async (exp_h *h, const exp_regexp *regexps,
+                  pcre2_match_data *match_data,
+                  GCancellable *cancellable,
+                  ExpAsyncFunc done, gpointer user_data)
+{
+  GSource *source;
+  struct exp_source *s;
+  guint id;
+
+  source = g_source_new (&exp_source_funcs, sizeof *s);
+  s = (struct exp_source *) source;
+  s->h = h;
+  s->regexps = regexps;
+  s->match_data = match_data;
+  s->r = exp_expect_start (h, regexps, match_data);
+  s->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  g_source_set_name (source, "exp_expect_async");
+  g_source_set_callback (source, (GSourceFunc) done, user_data, NULL);
+
+  if (s->r != EXP_AGAIN)
+    /* Already decided, dispatch on the next iteration. */
+    g_source_set_ready_time (source, 0);
+  else {
+    s->fd_tag = g_source_add_unix_fd (source, h->fd,
+                                      G_IO_IN | G_IO_HUP | G_IO_ERR);
+    if (h->timeout >= 0)
+      g_source_set_ready_time (source, g_get_monotonic_time () +
+                               (gint64) h->timeout * 1000);
+    if (cancellable) {
+      GSource *child = g_cancellable_source_new (cancellable);
+      g_source_set_callback (child, (GSourceFunc) exp_cancelled, NULL, NULL);
+      g_source_add_child_source (source, child);
+      g_source_unref (child);
+    }
+  }
+
+  id = g_source_attach (source, g_main_context_get_thread_default ());
+  g_source_unref (source);
+  return id;
+}
@@ -0,0 +1,46 @@
+/* miniexpect GLib integration
+ * Copyright (C) 2024 Ailrk
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MINIEXPECT_GLIB_H_
+#define MINIEXPECT_GLIB_H_
+
+#include <gio/gio.h>
+
+#include "expect.h"
+
+/* Called once the expect finishes, with what exp_expect would have
+ * returned, or EXP_CANCELLED.
+ */
+typedef void (*ExpAsyncFunc) (exp_h *h, int r, gpointer user_data);
+
+/* Expect without blocking.  The pty is watched from the thread-default
+ * main context and matched as data arrives.  done is always called
+ * from the main loop, never from inside this call, even when the
+ * buffer already holds a match.  regexps and match_data must stay
+ * valid until then.  h->timeout applies to the whole expect, as in
+ * exp_expect.
+ *
+ * Cancelling the cancellable (which may be NULL) completes the expect
+ * with EXP_CANCELLED.  Returns the source id.
+ */
+extern guint exp_expect_async (exp_h *h, const exp_regexp *regexps,
+                               pcre2_match_data *match_data,
+                               GCancellable *cancellable,
+                               ExpAsyncFunc done, gpointer user_data);
+
+#endif /* MINIEXPECT_GLIB_H_ */
@@ -0,0 +1,649 @@
+/* End to end benchmark of a kirby session against nixsim.
+ *
+ *   make bench
+ *   ./kbbench [-x nixsim] [-n rounds] [-c] [size ...]
+ *   ./kbbench -p sessions [-e ns] [-x nixsim] [-n rounds] [size ...]
+ *   ./kbbench -b commands [-x nixsim] [-n rounds]
+ *   ./kbbench -j [-c] [-x nixsim] [-n rounds] [size ...]
+ *   ./kbbench -f ms [-x nixsim] [-n rounds]
+ *   ./kbbench -t [-c] [-e ns] [-x nixsim] [-n rounds] [size ...]
+ *   ./kbbench -r refreshes [-x nixsim] [size ...]
+ *   ./kbbench -a [-x nixsim] [-n rounds] [size ...]
+ *   ./kbbench -l [-x nixsim] [-n rounds] [size ...]
+ *   ./kbbench -q paths [-x nixsim] [-n rounds] [size ...]
+ *
+ * For every output size it spawns the simulator and times each phase
+ * of a cold config refresh from the session's stats, reporting the
+ * median over the rounds. Sizes take k, m and g suffixes. The phases
+ * that handle the output also report their throughput.
+ *
+ * With -p it times refreshes through pools of 1, 2, 4 … up to
+ * `sessions` sessions instead, and reports the speedup over one. -e
+ * makes the simulator spend `ns` per byte, like nix evaluating.
+ *
+ * With -b it times that many commands run one at a time, each waiting
+ * for its output and prompt, against the same typed in one batch.
+ *
+ * With -j it times warm refreshes printing the config with `:p`
+ * against the same printed as JSON.
+ *
+ * With -f it kills the repl and times getting the config again, on a
+ * handle that respawns it cold against a supervisor that swaps in its
+ * standby. A fresh simulator takes `ms` for its first evaluation. It
+ * also times `kb_supervisor_failover` off a session stuck in its query
+ * on a simulator that ignores SIGHUP, which must not wait for it.
+ *
+ * With -t it reports where warm refreshes spend their time, the p50
+ * and p99 of each phase from the handle's stats.
+ *
+ * With -r it runs that many warm refreshes on one session and reports
+ * resident memory and the session's arenas along the way, which should
+ * stay flat once the first refreshes settled.
+ *
+ * With -a it parses the output on token pools made with different
+ * arena options, and reports the page faults and time of the first
+ * parse on a fresh pool and the median of the later ones, each after
+ * clearing the pool like a refresh does.
+ *
+ * With -l it times matching prompts and reading the pty for outputs
+ * doubling in size, and reports both per MiB read. Matching resumes
+ * where the last attempt stopped, so the time per MiB should stay flat
+ * as the output grows rather than grow with it.
+ *
+ * With -q it gets the values at that many paths spread over the config
+ * with one coalesced `kb_get_paths`, with a `kb_get_paths` per path and
+ * by `kb_access` on a lazy tree, which expands the attribute each path
+ * is in.
+ * */
+#define _GNU_SOURCE
+#include "kirby.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_ROUNDS 64
+
+/* Stages of a cold refresh, spawning and then the phases of the job. */
+#define ST_SPAWN 0
+#define ST_N     (1 + KB_NPHASES)
+
+
+static double now_ms () {
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+
+static int cmp_double (const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+/* Benchmarks stop at the first failure. */
+static long check (long r) {
+    if (r < 0) {
+        fprintf (stderr, "kbbench: %s\n", kb_strerror (r));
+        exit (EXIT_FAILURE);
+    }
+    return r;
+}
+
+
+static size_t parse_size (const char *s) {
+    char  *end;
+    size_t n = strtoull (s, &end, 10);
+    switch (*end) {
+        case 'g': case 'G': n <<= 10; // fallthrough
+        case 'm': case 'M': n <<= 10; // fallthrough
+        case 'k': case 'K': n <<= 10;
+    }
+    return n;
+}
+
+
+/* One cold refresh, a fresh session getting the config, timed by the
+ * phases its stats keep. `bytes` is what each stage went over, 0 for
+ * the ones that do not see the output.
+ * */
+static void run (const char *sim, size_t size, bool colour, double t[ST_N], size_t bytes[ST_N]) {
+    char       arg[32];
+    char      *argv[] = { (char *)sim, "-s", arg, colour ? "-c" : NULL, NULL };
+    NixpTree   tree;
+    kb_handle *h;
+    double     t0;
+
+    snprintf (arg, sizeof(arg), "%zu", size);
+
+    t0 = now_ms (); h = kb_handle_newv (NULL, argv); t[ST_SPAWN] = now_ms () - t0;
+    if (h == NULL) check (KB_SPAWN);
+    check (kb_get_config (h, &tree));
+    memset (bytes, 0, ST_N * sizeof(size_t));
+    for (int i = 0; i < KB_NPHASES; ++i) t[1 + i] = h->stats.ns[i] / 1e6;
+    bytes[1 + KB_PHASE_READ] = bytes[1 + KB_PHASE_MATCH] = bytes[1 + KB_PHASE_ANSI] = h->stats.bytes_read;
+    bytes[1 + KB_PHASE_PARSE] = bytes[1 + KB_PHASE_TREE] = h->stats.bytes;
+    kb_handle_close (h);
+}
+
+
+static void bench (const char *sim, size_t size, int rounds, bool colour) {
+    double samples[ST_N][MAX_ROUNDS];
+    double t[ST_N];
+    size_t bytes[ST_N];
+
+    for (int r = 0; r < rounds; ++r) {
+        run (sim, size, colour, t, bytes);
+        for (int s = 0; s < ST_N; ++s) samples[s][r] = t[s];
+    }
+
+    printf ("output %zu bytes read, %zu without ansi codes, %d rounds\n",
+            bytes[1 + KB_PHASE_READ], bytes[1 + KB_PHASE_PARSE], rounds);
+    for (int s = 0; s < ST_N; ++s) {
+        qsort (samples[s], rounds, sizeof(double), cmp_double);
+        double ms = samples[s][rounds / 2];
+        printf ("  %-14s %10.3f ms", s == ST_SPAWN ? "spawn" : kb_phase_name (s - 1), ms);
+        if (bytes[s] > 0 && ms > 0) printf (" %10.1f MiB/s", bytes[s] / (ms / 1e3) / (1 << 20));
+        printf ("\n");
+    }
+}
+
+
+/* Warm refreshes through a pool of `n` sessions, the median in ms.
+ * Attributes are made deep, a config has tens of them, not thousands.
+ * */
+static double pool_ms (const char *sim, size_t size, long cost, int n, int rounds, unsigned *ntoks) {
+    char      arg[32], ns[32];
+    char     *argv[] = { (char *)sim, "-s", arg, "-e", ns, "-d", "6", NULL };
+    double    samples[MAX_ROUNDS];
+    NixpTree  tree;
+    kb_pool  *pool;
+
+    snprintf (arg, sizeof(arg), "%zu", size);
+    snprintf (ns, sizeof(ns), "%ld", cost);
+    if ((pool = kb_pool_new (NULL, n, argv)) == NULL) check (KB_SPAWN);
+    check (kb_pool_get_config (pool, &tree)); // defines the bindings.
+    for (int r = 0; r < rounds; ++r) {
+        double t0 = now_ms ();
+        check (kb_pool_get_config (pool, &tree));
+        samples[r] = now_ms () - t0;
+    }
+    *ntoks = tree.ntoks;
+    kb_pool_close (pool);
+    qsort (samples, rounds, sizeof(double), cmp_double);
+    return samples[rounds / 2];
+}
+
+
+static void bench_pool (const char *sim, size_t size, long cost, int maxn, int rounds) {
+    double   one = 0;
+    unsigned ntoks;
+
+    printf ("output %zu bytes, %ld ns per byte, %d rounds\n", size, cost, rounds);
+    for (int n = 1; ; n = n * 2 < maxn ? n * 2 : maxn) {
+        double ms = pool_ms (sim, size, cost, n, rounds, &ntoks);
+        if (n == 1) one = ms;
+        printf ("  %3d sessions %10.3f ms %6.2fx %10u tokens\n", n, ms, one / ms, ntoks);
+        if (n == maxn) break;
+    }
+}
+
+
+static void bench_batch (const char *sim, int n, int rounds) {
+    char       *argv[] = { (char *)sim, NULL };
+    const char *cmds[n];
+    char        cmd[n][32];
+    double      one[MAX_ROUNDS], batch[MAX_ROUNDS];
+    kb_handle  *h;
+
+    for (int i = 0; i < n; ++i) {
+        snprintf (cmd[i], sizeof(cmd[i]), "x%d = %d", i, i);
+        cmds[i] = cmd[i];
+    }
+    if ((h = kb_handle_newv (NULL, argv)) == NULL) check (KB_SPAWN);
+    check (kb_batch (h, cmds, 1, NULL, NULL)); // the repl is up.
+    for (int r = 0; r < rounds; ++r) {
+        double t0 = now_ms ();
+        for (int i = 0; i < n; ++i) check (kb_batch (h, &cmds[i], 1, NULL, NULL));
+        one[r] = now_ms () - t0;
+
+        t0 = now_ms ();
+        check (kb_batch (h, cmds, n, NULL, NULL));
+        batch[r] = now_ms () - t0;
+    }
+    kb_handle_close (h);
+
+    qsort (one, rounds, sizeof(double), cmp_double);
+    qsort (batch, rounds, sizeof(double), cmp_double);
+    printf ("%d commands, %d rounds\n", n, rounds);
+    printf ("  %-14s %10.3f ms\n", "one at a time", one[rounds / 2]);
+    printf ("  %-14s %10.3f ms\n", "batched", batch[rounds / 2]);
+}
+
+
+/* Warm refreshes of one session, the median in ms. */
+static double refresh_ms (const char *sim, size_t size, bool colour, bool json, int rounds, unsigned *ntoks) {
+    char       arg[32];
+    char      *argv[] = { (char *)sim, "-s", arg, colour ? "-c" : NULL, NULL };
+    double     samples[MAX_ROUNDS];
+    NixpTree   tree;
+    kb_handle *h;
+
+    snprintf (arg, sizeof(arg), "%zu", size);
+    if ((h = kb_handle_newv (NULL, argv)) == NULL) check (KB_SPAWN);
+    h->json = json;
+    check (kb_get_config (h, &tree)); // defines the bindings.
+    for (int r = 0; r < rounds; ++r) {
+        double t0 = now_ms ();
+        check (kb_get_config (h, &tree));
+        samples[r] = now_ms () - t0;
+    }
+    *ntoks = tree.ntoks;
+    kb_handle_close (h);
+    qsort (samples, rounds, sizeof(double), cmp_double);
+    return samples[rounds / 2];
+}
+
+
+static void bench_json (const char *sim, size_t size, bool colour, int rounds) {
+    unsigned ntoks;
+    double   ms;
+
+    printf ("output %zu bytes, %d rounds\n", size, rounds);
+    ms = refresh_ms (sim, size, colour, false, rounds, &ntoks);
+    printf ("  %-14s %10.3f ms %10.1f MiB/s %10u tokens\n", ":p", ms, size / (ms / 1e3) / (1 << 20), ntoks);
+    ms = refresh_ms (sim, size, colour, true, rounds, &ntoks);
+    printf ("  %-14s %10.3f ms %10.1f MiB/s %10u tokens\n", "json", ms, size / (ms / 1e3) / (1 << 20), ntoks);
+}
+
+
+/* Kill the repl of `h` and wait until it is gone. */
+static void kill_repl (kb_handle *h) {
+    siginfo_t info;
+    pid_t     pid = exp_get_pid (h->exp_h);
+    kill (pid, SIGKILL);
+    waitid (P_PID, pid, &info, WEXITED | WNOWAIT);
+}
+
+
+static void bench_phases (const char *sim, size_t size, bool colour, long cost, int rounds) {
+    char       arg[32], ns[32];
+    char      *argv[] = { (char *)sim, "-s", arg, "-e", ns, colour ? "-c" : NULL, NULL };
+    NixpTree   tree;
+    kb_handle *h;
+
+    snprintf (arg, sizeof(arg), "%zu", size);
+    snprintf (ns, sizeof(ns), "%ld", cost);
+    if ((h = kb_handle_newv (NULL, argv)) == NULL) check (KB_SPAWN);
+    check (kb_get_config (h, &tree));
+    memset (h->hist, 0, sizeof(h->hist)); // only the warm refreshes.
+    for (int r = 0; r < rounds; ++r) check (kb_get_config (h, &tree));
+
+    printf ("output %zu bytes, %zu read, %zu parsed, %u tokens, %d rounds\n",
+            size, h->stats.bytes_read, h->stats.bytes, h->stats.ntoks, rounds);
+    printf ("  %-14s %10s %10s\n", "phase", "p50 ms", "p99 ms");
+    for (int i = 0; i < KB_NPHASES; ++i) {
+        printf ("  %-14s %10.3f %10.3f\n", kb_phase_name (i),
+                kb_stats_percentile (h, i, 0.5) / 1e6, kb_stats_percentile (h, i, 0.99) / 1e6);
+    }
+    kb_handle_close (h);
+}
+
+
+/* Resident memory of this process in KiB. */
+static long rss_kib () {
+    long  size, rss = 0;
+    FILE *fp = fopen ("/proc/self/statm", "r");
+    if (fp != NULL) {
+        if (fscanf (fp, "%ld %ld", &size, &rss) != 2) rss = 0;
+        fclose (fp);
+    }
+    return rss * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+
+static void bench_rss (const char *sim, size_t size, int refreshes) {
+    char       arg[32];
+    char      *argv[] = { (char *)sim, "-s", arg, NULL };
+    int        every  = refreshes >= 10 ? refreshes / 10 : 1;
+    NixpTree   tree;
+    kb_handle *h;
+
+    snprintf (arg, sizeof(arg), "%zu", size);
+    if ((h = kb_handle_newv (NULL, argv)) == NULL) check (KB_SPAWN);
+    check (kb_get_config (h, &tree)); // defines the bindings.
+
+    printf ("output %zu bytes, %d refreshes\n", size, refreshes);
+    printf ("  %10s %10s %14s %14s %14s\n", "refreshes", "rss KiB", "session live", "tokpool live", "tokpool top");
+    for (int r = 0; r <= refreshes; ++r) {
+        if (r % every == 0) {
+            printf ("  %10d %10ld %14zu %14zu %14zu\n", r, rss_kib (),
+                    arena_stats (h->arena).live, arena_stats (&h->tokpool).live, h->tokpool.size);
+        }
+        if (r < refreshes) check (kb_get_config (h, &tree));
+    }
+    kb_handle_close (h);
+}
+
+
+/* Warm refreshes of one session, the medians of the match and read
+ * phases in ns, and the bytes read from the pty.
+ * */
+static void match_ns (const char *sim, size_t size, int rounds, double *match, double *read, size_t *bytes) {
+    char       arg[32];
+    char      *argv[] = { (char *)sim, "-s", arg, NULL };
+    double     m[MAX_ROUNDS], r[MAX_ROUNDS];
+    NixpTree   tree;
+    kb_handle *h;
+
+    snprintf (arg, sizeof(arg), "%zu", size);
+    if ((h = kb_handle_newv (NULL, argv)) == NULL) check (KB_SPAWN);
+    check (kb_get_config (h, &tree)); // defines the bindings.
+    for (int i = 0; i < rounds; ++i) {
+        check (kb_get_config (h, &tree));
+        m[i] = h->stats.ns[KB_PHASE_MATCH];
+        r[i] = h->stats.ns[KB_PHASE_READ];
+    }
+    *bytes = h->stats.bytes_read;
+    kb_handle_close (h);
+    qsort (m, rounds, sizeof(double), cmp_double);
+    qsort (r, rounds, sizeof(double), cmp_double);
+    *match = m[rounds / 2];
+    *read  = r[rounds / 2];
+}
+
+
+static void bench_linear (const char *sim, const size_t *sizes, int n, int rounds) {
+    double first = 0;
+
+    printf ("%d rounds\n", rounds);
+    printf ("  %12s %12s %14s %14s %8s\n", "bytes read", "match ms", "match ms/MiB", "read ms/MiB", "vs first");
+    for (int i = 0; i < n; ++i) {
+        double match, read, mib;
+        size_t bytes;
+
+        match_ns (sim, sizes[i], rounds, &match, &read, &bytes);
+        mib = (double)bytes / (1 << 20);
+        if (i == 0) first = match / mib;
+        printf ("  %12zu %12.3f %14.3f %14.3f %7.2fx\n", bytes, match / 1e6, match / 1e6 / mib, read / 1e6 / mib,
+                match / mib / first);
+    }
+}
+
+
+static void bench_paths (const char *sim, size_t size, int n, int rounds) {
+    char        arg[32];
+    char       *argv[] = { (char *)sim, "-s", arg, NULL };
+    const char *paths[n];
+    char        path[n][32];
+    int         nodes[n];
+    double      coalesced[MAX_ROUNDS], each[MAX_ROUNDS], lazy[MAX_ROUNDS];
+    NixpTree    tree, values;
+    kb_handle  *h;
+    unsigned    members;
+
+    snprintf (arg, sizeof(arg), "%zu", size);
+    if ((h = kb_handle_newv (NULL, argv)) == NULL) check (KB_SPAWN);
+    check (kb_get_config_lazy (h, &tree)); // defines the bindings.
+    members = nixp_tree_tok (&tree, 0)->size;
+    for (int i = 0; i < n; ++i) {
+        snprintf (path[i], sizeof(path[i]), "m%lu.a%d", (unsigned long)i * members / n, i % 4);
+        paths[i] = path[i];
+    }
+    check (kb_get_paths (h, &values, paths, n, nodes));
+    for (int i = 0; i < n; ++i) {
+        if (nodes[i] < 0) {
+            fprintf (stderr, "kbbench: no value at %s\n", paths[i]);
+            exit (EXIT_FAILURE);
+        }
+    }
+
+    for (int r = 0; r < rounds; ++r) {
+        double t0 = now_ms ();
+        check (kb_get_paths (h, &values, paths, n, nodes));
+        coalesced[r] = now_ms () - t0;
+
+        t0 = now_ms ();
+        for (int i = 0; i < n; ++i) check (kb_get_paths (h, &values, &paths[i], 1, nodes));
+        each[r] = now_ms () - t0;
+
+        t0 = now_ms ();
+        check (kb_get_config_lazy (h, &tree));
+        for (int i = 0; i < n; ++i) {
+            if (kb_access (h, &tree, paths[i]) < 0) check (KB_PARSE);
+        }
+        lazy[r] = now_ms () - t0;
+    }
+    kb_handle_close (h);
+
+    qsort (coalesced, rounds, sizeof(double), cmp_double);
+    qsort (each, rounds, sizeof(double), cmp_double);
+    qsort (lazy, rounds, sizeof(double), cmp_double);
+    printf ("output %zu bytes, %u members, %d paths, %d rounds\n", size, members, n, rounds);
+    printf ("  %-14s %10.3f ms\n", "coalesced", coalesced[rounds / 2]);
+    printf ("  %-14s %10.3f ms\n", "per path", each[rounds / 2]);
+    printf ("  %-14s %10.3f ms\n", "lazy tree", lazy[rounds / 2]);
+}
+
+
+/* Minor page faults of this process so far. */
+static long minflt () {
+    struct rusage u;
+    getrusage (RUSAGE_SELF, &u);
+    return u.ru_minflt;
+}
+
+
+/* Parse `output` on a pool cleared first, like a refresh. */
+static double parse_ms (Arena *a, const char *output, size_t n, long *faults) {
+    NixpParser p;
+    NixpTree   tree;
+    long       f0 = minflt ();
+    double     t0 = now_ms ();
+    char      *in;
+
+    arena_clear (a);
+    in = arena_alloc (a, n);
+    memcpy (in, output, n);
+    nixp_init (&p, a);
+    if (nixp_parse (&p, in, n) < 0) {
+        fprintf (stderr, "failed to parse nixsim output of %zu bytes\n", n);
+        exit (EXIT_FAILURE);
+    }
+    nixp_tree (&tree, &p, in, n);
+    t0      = now_ms () - t0;
+    *faults = minflt () - f0;
+    return t0;
+}
+
+
+static void bench_arena (const char *sim, size_t size, int rounds) {
+    static const struct { const char *name; ArenaOpts opts; } cfgs[] = {
+        { "default",         { .reserve = 1ul << 30 } },
+        { "commit 2m",       { .reserve = 1ul << 30, .commit = 1ul << 21 } },
+        { "populate",        { .reserve = 1ul << 30, .populate = true } },
+        { "hugepage",        { .reserve = 1ul << 30, .hugepage = true } },
+        { "hugepage 2m",     { .reserve = 1ul << 30, .commit = 1ul << 21, .hugepage = true } },
+        { "hugepage pop",    { .reserve = 1ul << 30, .populate = true, .hugepage = true } },
+    };
+    char       arg[32];
+    char      *argv[] = { (char *)sim, "-s", arg, NULL };
+    NixpTree   tree;
+    kb_handle *h;
+    char      *output;
+    size_t     n;
+
+    snprintf (arg, sizeof(arg), "%zu", size);
+    if ((h = kb_handle_newv (NULL, argv)) == NULL) check (KB_SPAWN);
+    check (kb_get_config (h, &tree));
+    n      = tree.size;
+    output = malloc (n);
+    memcpy (output, tree.input, n);
+    kb_handle_close (h);
+
+    printf ("output %zu bytes, %d rounds\n", n, rounds);
+    printf ("  %-14s %10s %10s %10s %10s\n", "opts", "cold ms", "faults", "warm ms", "faults");
+    for (size_t c = 0; c < sizeof(cfgs) / sizeof(cfgs[0]); ++c) {
+        double ms[MAX_ROUNDS], cold;
+        long   faults, cold_faults, warm_faults = 0;
+        Arena  a = arena_new_opts ("bench", &cfgs[c].opts);
+
+        cold = parse_ms (&a, output, n, &cold_faults);
+        for (int r = 0; r < rounds; ++r) {
+            ms[r] = parse_ms (&a, output, n, &faults);
+            warm_faults += faults;
+        }
+        arena_delete (&a);
+        qsort (ms, rounds, sizeof(double), cmp_double);
+        printf ("  %-14s %10.3f %10ld %10.3f %10ld\n", cfgs[c].name, cold, cold_faults, ms[rounds / 2], warm_faults / rounds);
+    }
+    free (output);
+}
+
+
+static void bench_failover (const char *sim, long cold, int rounds) {
+    char           ms[32];
+    char          *argv[] = { (char *)sim, "-i", ms, NULL };
+    char          *hung_argv[] = { (char *)sim, "-i", ms, "-H", NULL };
+    double         respawn[MAX_ROUNDS], swap[MAX_ROUNDS], hung[MAX_ROUNDS];
+    NixpTree       tree;
+    kb_handle     *h, *sh;
+    kb_supervisor *s, *stuck;
+    kb_job         job;
+
+    snprintf (ms, sizeof(ms), "%ld", cold);
+    if ((h = kb_handle_newv (NULL, argv)) == NULL || (s = kb_supervisor_new (NULL, argv)) == NULL) check (KB_SPAWN);
+    if ((stuck = kb_supervisor_new (NULL, hung_argv)) == NULL) check (KB_SPAWN);
+    check (kb_get_config (h, &tree));
+    check (kb_supervisor_get_config (s, &tree));
+    for (int r = 0; r < rounds; ++r) {
+        usleep ((cold + 100) * 1000); // the standby is warm again.
+
+        kill_repl (h);
+        double t0 = now_ms ();
+        check (kb_get_config (h, &tree));
+        respawn[r] = now_ms () - t0;
+
+        kill_repl (kb_supervisor_handle (s));
+        t0 = now_ms ();
+        check (kb_supervisor_get_config (s, &tree));
+        swap[r] = now_ms () - t0;
+
+        // a session stuck in the query, on a repl that ignores SIGHUP.
+        if (r == 0) kb_supervisor_failover (stuck); // onto a standby with the bindings.
+        usleep ((cold + 100) * 1000);
+        sh = kb_supervisor_handle (stuck);
+        kb_job_init (&job, sh, &tree, kb_config_key (sh));
+        kb_job_step (&job, exp_expect (sh->exp_h, job.wait, sh->match_data)); // the query is typed.
+        usleep (50 * 1000);
+        t0 = now_ms ();
+        kb_supervisor_failover (stuck);
+        hung[r] = now_ms () - t0;
+    }
+    kb_supervisor_close (stuck);
+    kb_supervisor_close (s);
+    kb_handle_close (h);
+
+    qsort (respawn, rounds, sizeof(double), cmp_double);
+    qsort (swap, rounds, sizeof(double), cmp_double);
+    qsort (hung, rounds, sizeof(double), cmp_double);
+    printf ("first evaluation %ld ms, %d rounds\n", cold, rounds);
+    printf ("  %-14s %10.3f ms\n", "respawn", respawn[rounds / 2]);
+    printf ("  %-14s %10.3f ms\n", "standby", swap[rounds / 2]);
+    printf ("  %-14s %10.3f ms\n", "hung failover", hung[rounds / 2]);
+}
+
+
+int main (int argc, char **argv) {
+    const char *sim    = "./nixsim";
+    int         rounds = 5;
+    bool        colour = false;
+    int         pool   = 0;
+    int         batch  = 0;
+    long        cost   = 0;
+    bool        json   = false;
+    long        cold   = 0;
+    bool        phases = false;
+    int         refreshes = 0;
+    bool        arenas = false;
+    bool        linear = false;
+    int         npaths = 0;
+    int         opt;
+    static const char *sizes[] = { "1k", "64k", "1m", "16m", "128m" };
+
+    while ((opt = getopt (argc, argv, "x:n:cp:e:b:jf:tr:alq:")) != -1) {
+        switch (opt) {
+            case 'x': sim    = optarg; break;
+            case 'n': rounds = atoi (optarg); break;
+            case 'c': colour = true; break;
+            case 'p': pool   = atoi (optarg); break;
+            case 'e': cost   = atol (optarg); break;
+            case 'b': batch  = atoi (optarg); break;
+            case 'j': json   = true; break;
+            case 'f': cold   = atol (optarg); break;
+            case 't': phases = true; break;
+            case 'r': refreshes = atoi (optarg); break;
+            case 'a': arenas = true; break;
+            case 'l': linear = true; break;
+            case 'q': npaths = atoi (optarg); break;
+            default:
+                fprintf (stderr, "usage: %s [-x nixsim] [-n rounds] [-c] [-p sessions] [-e ns] [-b commands] [-j] [-f ms] [-t] [-r refreshes] [-a] [-l] [-q paths] [size ...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (rounds < 1) rounds = 1;
+    if (rounds > MAX_ROUNDS) rounds = MAX_ROUNDS;
+
+    kb_init ();
+    if (cold > 0) {
+        setenv ("KIRBY_NO_CACHE", "1", 1);
+        bench_failover (sim, cold, rounds);
+    } else if (refreshes > 0) {
+        setenv ("KIRBY_NO_CACHE", "1", 1);
+        if (optind == argc) bench_rss (sim, parse_size ("64k"), refreshes);
+        for (int i = optind; i < argc; ++i) bench_rss (sim, parse_size (argv[i]), refreshes);
+    } else if (npaths > 0) {
+        setenv ("KIRBY_NO_CACHE", "1", 1); // a snapshot is a whole tree, not a lazy one.
+        if (optind == argc) bench_paths (sim, parse_size ("1m"), npaths, rounds);
+        for (int i = optind; i < argc; ++i) bench_paths (sim, parse_size (argv[i]), npaths, rounds);
+    } else if (linear) {
+        size_t ls[64];
+        int    n = 0;
+        setenv ("KIRBY_NO_CACHE", "1", 1);
+        if (optind == argc) {
+            for (size_t size = 1 << 20; size <= 32 << 20; size *= 2) ls[n++] = size;
+        }
+        for (int i = optind; i < argc && n < 64; ++i) ls[n++] = parse_size (argv[i]);
+        bench_linear (sim, ls, n, rounds);
+    } else if (arenas) {
+        setenv ("KIRBY_NO_CACHE", "1", 1);
+        if (optind == argc) bench_arena (sim, parse_size ("16m"), rounds);
+        for (int i = optind; i < argc; ++i) bench_arena (sim, parse_size (argv[i]), rounds);
+    } else if (batch > 0) {
+        bench_batch (sim, batch, rounds);
+    } else if (pool > 0) {
+        setenv ("KIRBY_NO_CACHE", "1", 1); // time evaluations, not snapshots.
+        if (optind == argc) bench_pool (sim, parse_size ("16m"), cost, pool, rounds);
+        for (int i = optind; i < argc; ++i) bench_pool (sim, parse_size (argv[i]), cost, pool, rounds);
+    } else if (phases) {
+        setenv ("KIRBY_NO_CACHE", "1", 1);
+        if (optind == argc) bench_phases (sim, parse_size ("16m"), colour, cost, rounds);
+        for (int i = optind; i < argc; ++i) bench_phases (sim, parse_size (argv[i]), colour, cost, rounds);
+    } else if (json) {
+        setenv ("KIRBY_NO_CACHE", "1", 1);
+        if (optind == argc) bench_json (sim, parse_size ("16m"), colour, rounds);
+        for (int i = optind; i < argc; ++i) bench_json (sim, parse_size (argv[i]), colour, rounds);
+    } else if (optind < argc) {
+        setenv ("KIRBY_NO_CACHE", "1", 1);
+        for (int i = optind; i < argc; ++i) bench (sim, parse_size (argv[i]), rounds, colour);
+    } else {
+        setenv ("KIRBY_NO_CACHE", "1", 1);
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) bench (sim, parse_size (sizes[i]), rounds, colour);
+    }
+    return EXIT_SUCCESS;
+}
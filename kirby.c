@@ -1,49 +1,256 @@
+#define _GNU_SOURCE
 #include "kirby.h"
 #include "arena.h"
 #include "expect.h"
 #include "nixp.h"
 #include "pcre2.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 Arena kb_arena;
 
 
-pcre2_general_context *gctx = NULL;
-pcre2_compile_context *cctx = NULL;
-pcre2_match_context   *mctx = NULL;
+static pcre2_general_context *gctx = NULL;
+static pcre2_compile_context *cctx = NULL;
 
 
-kb_handle *kb_handle_new () {
-    putenv("TERM=dumb"); // avoid ansii escape code.
-    kb_handle *h  = arena_alloc (&kb_arena, sizeof(kb_handle));
-    h->exp_h      = exp_spawnl ("nix", "nix", "repl", NULL);
-    h->match_data = pcre2_match_data_create (4, gctx);
+/* Patterns shared by all handles, compiled once in `kb_init`. */
+static pcre2_code *ansii_re = NULL;
+
+/* Fixed strings are matched as needles, not patterns. */
+#define KB_PROMPT "nix-repl>"
+
+
+/* JIT stack of each handle. The default 32K machine stack is enough
+ * for the fixed patterns, the bound is for user supplied ones.
+ * */
+#define KB_JIT_STACK_MIN (32 * 1024)
+#define KB_JIT_STACK_MAX (512 * 1024)
+
+
+/* Token pools only hold one refresh worth of output and tokens, but
+ * they are large and short lived. `kbbench -a` parses 16 MiB of output
+ * with 25k page faults and in 390 ms on base pages, huge pages take it
+ * to 50 faults and 330 ms. Committing 2 MiB up front saves the first
+ * refresh 40 ms and small configs their faults, populating only adds
+ * faults on pages that were never touched.
+ * */
+static const ArenaOpts kb_tokpool_opts = {
+    .reserve  = 1ul << 30,
+    .commit   = 1ul << 21,
+    .hugepage = true,
+};
+
+
+inline static void *kb_pcre2_malloc (PCRE2_SIZE size, void *data) { return arena_alloc ((Arena *)data, size); }
+inline static void  kb_pcre2_free (void *p, void *data) { arena_free ((Arena *)data, p); }
+inline static void *kb_exp_malloc (size_t size, void *data) { return arena_alloc ((Arena *)data, size); }
+inline static void  kb_exp_free (void *ptr, void *data) { arena_free ((Arena *)data, ptr); }
+inline static void *kb_exp_realloc (void *ptr, size_t size, void *data) { return arena_realloc ((Arena *)data, ptr, size); }
+
+
+/* Monotonic time in ns, for the stats. */
+static int64_t now_ns () {
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+
+/* Time since `*t`, which moves on to now. */
+static uint64_t lap (int64_t *t) {
+    int64_t t0 = *t;
+    *t = now_ns ();
+    return *t - t0;
+}
+
+
+/* Spawn the repl, `argv`, or nix if it is NULL. KIRBY_REPLAY=file
+ * serves a recorded transcript instead, with the recorded timing, or
+ * as fast as possible if KIRBY_REPLAY_FAST is set.
+ * */
+static exp_h *spawn_repl (kb_handle *h) {
+    static char *nix[] = { "nix", "repl", NULL };
+    const char  *replay = getenv ("KIRBY_REPLAY");
+
+    if (replay != NULL)
+        return exp_spawn_replay_alloc (&h->exp_alloc, getenv ("KIRBY_REPLAY_FAST") ? EXP_SPAWN_REPLAY_FAST : 0, replay);
+    else if (h->argv != NULL)
+        return exp_spawnvf_alloc (&h->exp_alloc, 0, h->argv[0], h->argv);
+    else
+        return exp_spawnvf_alloc (&h->exp_alloc, 0, nix[0], nix);
+}
+
+
+/* Create a session on `arena`, or on the calling thread's arena if
+ * `arena` is NULL. That one is unmapped when the thread exits, so a
+ * session that outlives its thread, or is handed to another one,
+ * needs an arena of its own.
+ *
+ * KIRBY_RECORD=file records the session's pty transcript to `file`,
+ * across respawns. The first session of the process records to `file`,
+ * later ones to `file.1`, `file.2` …, so each transcript replays one
+ * session.
+ * */
+kb_handle *kb_handle_new (Arena *arena) {
+    return kb_handle_newv (arena, NULL);
+}
+
+
+/* Like `kb_handle_new`, but run `argv` as the repl instead of nix.
+ * `argv` is kept for respawns and must outlive the handle. Returns
+ * NULL if the repl could not be started.
+ * */
+kb_handle *kb_handle_newv (Arena *arena, char **argv) {
+    static unsigned nrecords = 0;
+    const char *record = getenv ("KIRBY_RECORD");
+    const char *stats  = getenv ("KIRBY_STATS");
+    char        path[PATH_MAX];
+    unsigned    i;
+    FILE       *fp;
+
+    if (arena == NULL) arena = arena_thread ();
+    kb_handle *h  = arena_alloc (arena, sizeof(kb_handle));
+    h->arena      = arena;
+    h->exp_alloc  = (struct exp_allocator){ kb_exp_malloc, kb_exp_free, kb_exp_realloc, arena };
+    h->tokpool    = arena_new_opts ("tokpool", &kb_tokpool_opts);
+    h->refresh    = arena_mark (&h->tokpool);
+    h->gctx       = pcre2_general_context_create (kb_pcre2_malloc, kb_pcre2_free, arena);
+    h->cctx       = pcre2_compile_context_create (h->gctx);
+    h->mctx       = pcre2_match_context_create (h->gctx);
+    h->jit_stack  = pcre2_jit_stack_create (KB_JIT_STACK_MIN, KB_JIT_STACK_MAX, h->gctx);
+    pcre2_jit_stack_assign (h->mctx, NULL, h->jit_stack);
+    h->argv       = argv;
+    h->nbindings  = 0;
+    h->key        = 0;
+    h->json       = getenv ("KIRBY_JSON") != NULL;
+    h->stats_fp   = NULL;
+    memset (&h->stats, 0, sizeof(h->stats));
+    memset (h->hist, 0, sizeof(h->hist));
+    h->match_data = pcre2_match_data_create (4, h->gctx);
+    h->exp_h      = spawn_repl (h);
+    if (h->exp_h == NULL) {
+        perror ("exp_spawnl");
+        kb_handle_close (h);
+        return NULL;
+    }
+    exp_set_match_context (h->exp_h, h->mctx);
+    if (record != NULL) {
+        if ((i = __atomic_fetch_add (&nrecords, 1, __ATOMIC_RELAXED)) > 0) {
+            snprintf (path, sizeof(path), "%s.%u", record, i);
+            record = path;
+        }
+        if ((fp = fopen (record, "w")) == NULL) perror (record); // the session goes on unrecorded.
+        else exp_set_record_file (h->exp_h, fp);
+    }
+    if (stats != NULL && (h->stats_fp = fopen (stats, "a")) == NULL) perror (stats);
     // exp_set_debug_file (h->exp_h, stdout);
     return h;
 }
 
 
-void kb_handle_close (kb_handle *h) {
+/* Whether the repl is still running. The exit status is left for
+ * `exp_close` to reap.
+ * */
+bool kb_alive (kb_handle *h) {
+    siginfo_t info = { 0 };
+    if (waitid (P_PID, exp_get_pid (h->exp_h), &info, WEXITED | WNOHANG | WNOWAIT) == -1) return false;
+    return info.si_pid == 0;
+}
+
+
+/* Replace a dead repl with a fresh one. The bindings died with it, the
+ * next job defines them again. Spawning does not wait for the repl to
+ * start, it comes up in the background and the next job's first
+ * prompt waits for it. If the spawn fails the dead repl is kept, so
+ * the handle stays valid and the next restart tries again.
+ * */
+static int kb_respawn (kb_handle *h) {
+    exp_h *eh;
+    if ((eh = spawn_repl (h)) == NULL) {
+        perror ("exp_spawnl");
+        return KB_SPAWN;
+    }
+    exp_set_record_file (eh, exp_get_record_file (h->exp_h));
     exp_close (h->exp_h);
+    h->nbindings = 0;
+    h->exp_h     = eh;
+    exp_set_match_context (h->exp_h, h->mctx);
+    return KB_OK;
+}
+
+
+bool kb_defined (kb_handle *h, const char *name) {
+    for (int i = 0; i < h->nbindings; ++i) {
+        if (strcmp (h->bindings[i], name) == 0) return true;
+    }
+    return false;
+}
+
+
+/* Record that the repl has `name` bound. Names are not copied. */
+static void kb_bind (kb_handle *h, const char *name) {
+    if (kb_defined (h, name) || h->nbindings == KB_MAX_BINDINGS) return;
+    h->bindings[h->nbindings++] = name;
+}
+
+
+/* Forget all bindings, so the next refresh evaluates everything again,
+ * e.g after the home-manager configuration changed.
+ * */
+void kb_forget (kb_handle *h) {
+    h->nbindings = 0;
+}
+
+
+void kb_handle_close (kb_handle *h) {
+    if (h->exp_h != NULL) {
+        FILE *record = exp_get_record_file (h->exp_h);
+        exp_close (h->exp_h);
+        if (record != NULL) fclose (record);
+    }
+    if (h->stats_fp != NULL) fclose (h->stats_fp);
     pcre2_match_data_free (h->match_data);
+    pcre2_jit_stack_free (h->jit_stack);
+    pcre2_match_context_free (h->mctx);
+    pcre2_compile_context_free (h->cctx);
+    pcre2_general_context_free (h->gctx);
+    arena_delete (&h->tokpool);
+    arena_free (h->arena, h);
 }
 
 
-pcre2_code *compile_re (const char *re) {
+/* Compile `re` and JIT it for both complete and partial matching, as
+ * expect always matches with PARTIAL_SOFT. The JIT is best effort, the
+ * interpreter is used where it is not available.
+ * */
+pcre2_code *compile_re (const char *re, uint32_t options, pcre2_compile_context *cctx) {
     int         errcode;
     PCRE2_SIZE  errffset;
     char        errmsg[256];
     pcre2_code *ret;
 
-    ret = pcre2_compile ((PCRE2_SPTR) re, PCRE2_ZERO_TERMINATED, 0, &errcode, &errffset, cctx);
+    ret = pcre2_compile ((PCRE2_SPTR) re, PCRE2_ZERO_TERMINATED, options, &errcode, &errffset, cctx);
     if (ret == NULL) {
         pcre2_get_error_message(errcode, (PCRE2_UCHAR8 *) errmsg, sizeof (errmsg));
         fprintf (stderr, "failed to compile regex %s: at offset %zu, %s", re, errffset, errmsg);
         exit (EXIT_FAILURE);
     }
+    pcre2_jit_compile (ret, PCRE2_JIT_COMPLETE | PCRE2_JIT_PARTIAL_SOFT);
     return ret;
 }
 
@@ -53,159 +260,1471 @@ static inline int is_sighup (int status) {
 }
 
 
-inline static void *kb_pcre2_malloc (PCRE2_SIZE size, void *data) { return arena_alloc (&kb_arena, size); }
-inline static void  kb_pcre2_free (void *a, void *b) { return; }
-inline static void *kb_exp_malloc (size_t size) { return arena_alloc (&kb_arena, size); }
-inline static void  kb_exp_free (void *ptr) { return; }
-inline static void *kb_exp_realloc (void *ptr, size_t size) { return arena_realloc (&kb_arena, ptr, size); }
-
-
+/* Must be called once, before any thread creates a handle. */
 void kb_init () {
-    kb_arena = arena_new ("kb_arena");
-    exp_init (kb_exp_malloc, kb_exp_free, kb_exp_realloc);
-    gctx = pcre2_general_context_create (kb_pcre2_malloc, kb_pcre2_free, NULL);
-    cctx = pcre2_compile_context_create (gctx);
-    mctx = pcre2_match_context_create (gctx);
+    putenv("TERM=dumb"); // avoid ansii escape code.
+    kb_arena  = arena_new ("kb_arena");
+    gctx      = pcre2_general_context_create (kb_pcre2_malloc, kb_pcre2_free, &kb_arena);
+    cctx      = pcre2_compile_context_create (gctx);
+    ansii_re  = compile_re ("\e\[[0-9;]*[mGKH]", 0, cctx);
+    atexit (kb_end); // lets ARENA_REPORT cover kb_arena on exit.
 }
 
 
 void kb_end () {
+    pcre2_code_free (ansii_re);
+    ansii_re = NULL;
     arena_delete (&kb_arena);
 }
 
 
+/* A job whose bindings failed to evaluate is left with this result. */
+#define KB_EVAL_ERROR 101
+
+
+/* The `kb_status` of an expect result. EXP_AGAIN is what a job that
+ * failed after its output arrived is left with.
+ * */
+static int kb_status_of (int r) {
+    switch (r) {
+        case 100:            return KB_OK;
+        case KB_EVAL_ERROR:  return KB_EVAL;
+        case EXP_EOF:        return KB_EOF;
+        case EXP_TIMEOUT:    return KB_TIMEOUT;
+        case EXP_PCRE_ERROR: return KB_PCRE;
+        case EXP_AGAIN:      return KB_PARSE;
+        default:             return KB_IO;
+    }
+}
+
+
+const char *kb_strerror (int status) {
+    switch (status) {
+        case KB_OK:      return "ok";
+        case KB_EOF:     return "the repl died";
+        case KB_TIMEOUT: return "the repl timed out";
+        case KB_IO:      return "i/o error";
+        case KB_PCRE:    return "pcre2 error";
+        case KB_PARSE:   return "failed to parse the config";
+        case KB_SPAWN:   return "failed to start the repl";
+        case KB_EVAL:    return "failed to evaluate the home-manager configuration";
+        default:         return "unknown error";
+    }
+}
+
+
+/* Expect `regexps` on the handle. Failures are reported and returned,
+ * the callers decide whether the session goes on.
+ * */
 int kb_expect (kb_handle *h, const exp_regexp *regexps) {
-    // run expect with prepared array.
     int r = exp_expect (h->exp_h, regexps, h->match_data);
     switch (r) {
         case EXP_EOF:
             fprintf (stderr, "unexpected EOF\n");
-            exit (EXIT_FAILURE);
+            break;
         case EXP_TIMEOUT:
             fprintf (stderr, "timeout\n");
-            exit (EXIT_FAILURE);
+            break;
         case EXP_ERROR:
-            perror ("exp_expt");
-            exit (EXIT_FAILURE);
+            perror ("exp_expect");
+            break;
         case EXP_PCRE_ERROR:
             fprintf (stderr, "pcre2 error: %d \n", exp_get_pcre_error (h->exp_h));
-            exit (EXIT_FAILURE);
-        default:
-            return r;
+            break;
     }
+    return r;
 }
 
 
-/* consume the next prompt */
-static void prompt (kb_handle *h) {
-    static pcre2_code * re = NULL;
-    if (re == NULL) re = compile_re ("nix-repl>");
-    switch (kb_expect(h,
-                (exp_regexp[]) {
-                    { 100, .re = re },
-                    { 0 }
-                })) {
-        case 100: break;
-        default: exit (EXIT_FAILURE);
+/* Copy `n` bytes of `src` to `dst` with ansi color codes removed, and
+ * return the copied size. `dst` needs room for `n + 1` bytes.
+ * */
+size_t kb_remove_ansii (kb_handle *h, char *dst, const char *src, size_t n) {
+    PCRE2_SIZE size = n + 1;
+    if (pcre2_substitute (ansii_re, (PCRE2_SPTR)src, n, 0,
+                          PCRE2_SUBSTITUTE_GLOBAL | PCRE2_SUBSTITUTE_EXTENDED,
+                          h->match_data, h->mctx,
+                          (PCRE2_SPTR)"", 0,
+                          (PCRE2_UCHAR *)dst, &size) < 0) {
+        memcpy (dst, src, n);
+        return n;
     }
+    return size;
 }
 
-/* Get output. `get` should always follow by a `command`. This makes
- * sure the expect buffer has the correct content.
+
+/* Write `cmd` to the repl without waiting for anything, its echo and
+ * output are collected with the prompt that follows them.
  * */
-static size_t get (kb_handle *h, char **out) {
-    char *p;
-    size_t size;
-    static pcre2_code * re = NULL;
-    if (re == NULL) re = compile_re ("(.*)(?=nix-repl>)");
-    switch (kb_expect(h,
-                (exp_regexp[]) {
-                    { 100, .re = re },
-                    { 0 }
-                })) {
-        case 100: break;
-        default: exit (EXIT_FAILURE);
+static int type (kb_handle *h, const char *cmd) {
+    if (exp_printf (h->exp_h, "%s", cmd) == -1) {
+        perror ("exp_printf");
+        return KB_IO;
     }
+    return KB_OK;
+}
 
-    if ((size = h->exp_h->next_match) == -1) {
-        fprintf(stderr, "get");
-        exit(EXIT_FAILURE);
-    }
 
-    p = arena_realloc(&kb_arena, 0, size);
-    memmove(p, h->exp_h->buffer, size);
-    *out = p;
-    return size;
+/* Leave the prompt just matched for the next command, the output in
+ * front of it stays in the buffer until the handle is driven again.
+ * */
+static void leave_prompt (kb_handle *h) {
+    h->exp_h->next_match = exp_get_match_start (h->exp_h);
 }
 
 
-/* type enter */
-static void enter (kb_handle *h) {
-    if (exp_printf (h->exp_h, "\n") == -1) {
-        perror ("exp_printf");
-        exit (EXIT_FAILURE);
+/* Copy the output of a typed ahead command out of the expect buffer,
+ * everything from its echo to the prompt just matched. The echo line is
+ * dropped and, if `strip`, ansi codes are stripped on the way. The copy
+ * lives on the token pool.
+ * */
+static char *copy_output (kb_handle *h, size_t *n, bool strip) {
+    size_t      size = exp_get_match_start (h->exp_h);
+    const char *view = exp_get_buffer (h->exp_h);
+    const char *eol  = memchr (view, '\n', size);
+    char       *output;
+
+    if (eol != NULL) {
+        size -= eol + 1 - view;
+        view  = eol + 1;
     }
+    output = arena_alloc(&h->tokpool, size + 1);
+    if (strip) {
+        *n = kb_remove_ansii(h, output, view, size);
+    } else {
+        *n = size;
+        memcpy(output, view, size);
+    }
+    return output;
 }
 
 
-/* remove ansi color code */
-static void remove_ansii (char *buffer, size_t n) {
-    static pcre2_code * re = NULL;
-    if (re == NULL) re = compile_re ("\e\[[0-9;]*[mGKH]");
-    pcre2_substitute (re, (PCRE2_SPTR)buffer, n, 0,
-                      PCRE2_SUBSTITUTE_GLOBAL | PCRE2_SUBSTITUTE_EXTENDED,
-                      NULL, NULL, // no matching
-                      (PCRE2_SPTR)"", 0,
-                      (PCRE2_UCHAR *)buffer, (PCRE2_SIZE *)&n);
+/* Type `n` commands, each followed by enter, with a single write. */
+static int type_lines (kb_handle *h, const char *const *cmds, int n) {
+    size_t len = 1;
+    char  *batch, *c;
+    int    r;
+
+    for (int i = 0; i < n; ++i) len += strlen (cmds[i]) + 1;
+    c = batch = arena_alloc (h->arena, len);
+    for (int i = 0; i < n; ++i) {
+        c    = stpcpy (c, cmds[i]);
+        *c++ = '\n';
+    }
+    *c = '\0';
+    r = type (h, batch);
+    arena_free (h->arena, batch);
+    return r;
 }
 
 
-/* Execute a command. It does the following:
- * 1. type the command
- * 2. consume the comamnd string echoed back in the pty
- * 3. type enter to run the command
+/* Run `n` commands without waiting for their echoes. They are typed
+ * with a single write once the repl prompts, the repl reads ahead, and
+ * the output of each ends at the prompt of the next. Unless `outputs`
+ * is NULL, the output of command `i`, without echo and ansi codes, is
+ * copied to `outputs[i]` and `sizes[i]` on the token pool.
+ *
+ * Like a job it waits for a prompt first, and leaves the last one for
+ * the next command.
  * */
-static void command (kb_handle *h, const char *cmd) {
-    if (exp_printf (h->exp_h, "%s", cmd) == -1) {
-        perror ("exp_printf");
-        exit (EXIT_FAILURE);
+int kb_batch (kb_handle *h, const char *const *cmds, int n, const char **outputs, size_t *sizes) {
+    int r = kb_expect (h, (exp_regexp[]) { { 100, .needle = KB_PROMPT }, { 0 } });
+    if (r != 100) return kb_status_of (r);
+    if ((r = type_lines (h, cmds, n)) < 0) return r;
+    for (int i = 0; i < n; ++i) {
+        exp_set_keep_buffer (h->exp_h, outputs != NULL);
+        r = kb_expect (h, (exp_regexp[]) { { 100, .needle = KB_PROMPT }, { 0 } });
+        exp_set_keep_buffer (h->exp_h, 0);
+        if (r != 100) return kb_status_of (r);
+        if (outputs != NULL) outputs[i] = copy_output (h, &sizes[i], true);
     }
-
-    pcre2_code *re = compile_re (cmd);
-    switch (kb_expect(h,
-                (exp_regexp[]) {
-                    { 100, .re = re },
-                    { 0 }
-                })) {
-        case 100: break;
-        default: exit (EXIT_FAILURE);
-    }
-    enter(h);
+    leave_prompt (h);
+    return KB_OK;
 }
 
 
 void kb_dump_parsetree(NixpParser *p, const char *input, size_t size) {
     const NixpToken *tok;
     for (int i = 0; i < p->next; ++i) {
-        tok = &p->pool[i];
+        tok = nixp_tok(p, i);
         printf("%d\n", i);
     }
 }
 
 
-void kb_get_config (kb_handle *h, NixpTree *tree) {
-    char *output;
-    prompt (h);
-    command (h, "hm = import <home-manager/modules> { configuration = ~/.config/home-manager/home.nix; pkgs = import <nixpkgs> {}; }");
-    command (h, ":p hm.config.kirby");
-    size_t size = get (h, &output);
-    remove_ansii(output, size);
+/* Bindings the config query needs, with the commands defining them. A
+ * session defines each one once, nix keeps what it evaluated through
+ * them, so later refreshes only pay for the query.
+ * */
+static const struct {
+    const char *name;
+    const char *cmd;
+} kb_config_bindings[] = {
+    { "hm", "hm = import <home-manager/modules> { configuration = ~/.config/home-manager/home.nix; pkgs = import <nixpkgs> {}; }" },
+};
+#define KB_CONFIG_NBINDINGS (sizeof(kb_config_bindings) / sizeof(kb_config_bindings[0]))
+#define KB_NAMES_QUERY    ":p builtins.attrNames " KB_CONFIG
+
+
+/* Move `job->cmd` to the next command, skipping bindings the session
+ * already has, and return it. The query is last, NULL after.
+ * */
+static const char *next_cmd (kb_job *job, size_t from) {
+    for (job->cmd = from; job->cmd < KB_CONFIG_NBINDINGS; ++job->cmd) {
+        if (!kb_defined (job->h, kb_config_bindings[job->cmd].name)) return kb_config_bindings[job->cmd].cmd;
+    }
+    return job->cmd == KB_CONFIG_NBINDINGS ? job->query : NULL;
+}
+
+
+/* Whether the command in front of the prompt just matched printed an
+ * error, which is reported. Its echo is skipped, a command can contain
+ * `error:` too.
+ * */
+static bool binding_failed (kb_handle *h) {
+    size_t      size = exp_get_match_start (h->exp_h);
+    const char *view = exp_get_buffer (h->exp_h);
+    const char *eol  = memchr (view, '\n', size);
+    const char *err;
+
+    if (eol == NULL) return false;
+    size -= eol + 1 - view;
+    if ((err = exp_memmem (eol + 1, size, "error:", 6)) == NULL) return false;
+    for (size = eol + 1 + size - err; size > 0 && isspace ((unsigned char)err[size - 1]); --size);
+    fprintf (stderr, "%.*s\n", (int)size, err);
+    return true;
+}
+
+
+static void wait_for (kb_job *job, const char *needle) {
+    job->wait[0] = (exp_regexp){ 100, .needle = needle };
+    job->wait[1] = (exp_regexp){ 0 };
+}
+
+
+/* Parse the output in front of the prompt just matched, see
+ * `copy_output`. The tree lives on the token pool with the output.
+ *
+ * JSON comes as a nix string, it is decoded in place. Colour codes
+ * can only be around the string, so they are left out with the quotes
+ * instead of stripped.
+ * */
+static int parse_output (kb_handle *h, NixpTree *tree, bool json, kb_stats *stats) {
+    int64_t     t      = now_ns ();
+    size_t      size;
+    char       *output = copy_output (h, &size, !json);
+    NixpParser  p;
+
+    if (json) size = nixp_unquote (output, size);
+    stats->ns[KB_PHASE_ANSI] += lap (&t);
+    stats->bytes             += size;
+    nixp_init(&p, &h->tokpool);
+    if ((json ? nixp_parse_json (&p, output, size) : nixp_parse (&p, output, size)) < 0) {
+        fprintf(stderr, "failed to parse kirby config\n");
+        return -1;
+    }
+    stats->ns[KB_PHASE_PARSE] += lap (&t);
+    nixp_tree(tree, &p, output, size);
+    stats->ns[KB_PHASE_TREE] += lap (&t);
+    return 0;
+}
+
+
+/* Turn the list of attribute names in `names` into the skeleton of the
+ * config, a set of thunks, `{ name = «thunk»; ... }`.
+ * */
+static int build_skeleton (kb_handle *h, NixpTree *tree, const NixpTree *names) {
+    static const char thunk[] = " = «thunk»; ";
+    const NixpToken  *list;
+    size_t            size = 4;
+    char             *input, *c;
+    NixpParser        p;
+
+    if (names->ntoks == 0 || (list = nixp_tree_tok(names, 0))->type != NIX_LIST) {
+        fprintf(stderr, "expecting a list of attribute names\n");
+        return -1;
+    }
+    for (int i = 0; i < list->size; ++i) {
+        const NixpToken *name = nixp_tree_tok(names, nixp_tok_get_child(list, i));
+        size += name->end - name->start + 2 + strlen(thunk);
+    }
+
+    // the names are printed as nix strings, they stay quoted as keys.
+    c = input = arena_alloc(&h->tokpool, size);
+    c = stpcpy(c, "{ ");
+    for (int i = 0; i < list->size; ++i) {
+        const NixpToken *name = nixp_tree_tok(names, nixp_tok_get_child(list, i));
+        if (name->type != NIX_STRING) {
+            fprintf(stderr, "expecting a list of attribute names\n");
+            return -1;
+        }
+        *c++ = '"';
+        c    = mempcpy(c, &names->input[name->start], name->end - name->start);
+        *c++ = '"';
+        c    = stpcpy(c, thunk);
+    }
+    c = stpcpy(c, "}");
+
+    nixp_init(&p, &h->tokpool);
+    if (nixp_parse(&p, input, c - input) < 0) return -1;
+    nixp_tree(tree, &p, input, c - input);
+    return 0;
+}
+
+
+/* Config snapshots. After every evaluation the tree is saved, keyed by
+ * a hash of everything the evaluation read: the nix files of the
+ * home-manager directory home.nix lives in, and the NIX_PATH and
+ * channel store paths, which change whenever a channel is updated. The
+ * repl command is part of the key too, so a stand-in repl never shares
+ * a snapshot with nix, and so is the query that printed the tree, `:p`
+ * or JSON, see `snapshot_key`. Set KIRBY_NO_CACHE to always evaluate.
+ * */
+#define KB_FNV_OFFSET 14695981039346656037ull
+#define KB_FNV_PRIME  1099511628211ull
+
+static uint64_t fnv1a (uint64_t h, const void *p, size_t n) {
+    for (const unsigned char *c = p; n > 0; --n, ++c) h = (h ^ *c) * KB_FNV_PRIME;
+    return h;
+}
+
+
+static uint64_t hash_str (uint64_t h, const char *s) { return fnv1a (h, s, strlen (s) + 1); }
+
+
+/* Hash `path` with the real path it resolves to, if any. */
+static uint64_t hash_realpath (uint64_t h, const char *path) {
+    char real[PATH_MAX];
+    h = hash_str (h, path);
+    return realpath (path, real) ? hash_str (h, real) : h;
+}
+
+
+/* Hashes of the config files, by path. A file is only read again when
+ * its stat changed since, so a refresh of an unchanged config costs a
+ * stat per file. Entries live on `kb_arena` under the lock, there is
+ * one per file the config ever had.
+ * */
+#define KB_FILE_NBUCKETS 64
+
+typedef struct kb_file {
+    struct kb_file *next;
+    dev_t           dev;
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtime;
+    uint64_t        hash;
+    char            path[];
+} kb_file;
+
+static kb_file        *kb_files[KB_FILE_NBUCKETS];
+static pthread_mutex_t kb_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* nftw has no user data, the walk sums file hashes here. Summing
+ * makes the key independent of the directory order.
+ * */
+static uint64_t kb_walk_sum;
+
+
+/* The hash of `path` and its content, from the cache if its stat did
+ * not change.
+ * */
+static uint64_t hash_file (const char *path, const struct stat *st) {
+    kb_file **bucket = &kb_files[hash_str (KB_FNV_OFFSET, path) % KB_FILE_NBUCKETS];
+    kb_file  *f;
+    char      buf[1 << 16];
+    ssize_t   r;
+    int       fd;
+
+    for (f = *bucket; f != NULL && strcmp (f->path, path) != 0; f = f->next);
+    if (f != NULL && f->dev == st->st_dev && f->ino == st->st_ino && f->size == st->st_size &&
+        f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+        return f->hash;
+    }
+    if (f == NULL) {
+        f       = arena_alloc (&kb_arena, sizeof(kb_file) + strlen (path) + 1);
+        strcpy (f->path, path);
+        f->next = *bucket;
+        *bucket = f;
+    }
+    f->dev   = st->st_dev;
+    f->ino   = st->st_ino;
+    f->size  = st->st_size;
+    f->mtime = st->st_mtim;
+    f->hash  = hash_str (KB_FNV_OFFSET, path);
+    if ((fd = open (path, O_RDONLY | O_CLOEXEC)) != -1) {
+        while ((r = read (fd, buf, sizeof(buf))) > 0) f->hash = fnv1a (f->hash, buf, r);
+        close (fd);
+    }
+    return f->hash;
+}
+
+
+/* Only nix files and the flake lock go into the config, version
+ * control directories are skipped whole.
+ * */
+static int walk_file (const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    static const char *const vcs[] = { ".git", ".hg", ".svn", ".jj" };
+    const char              *name  = path + ftw->base;
+    size_t                   len   = strlen (name);
+
+    if (type == FTW_D) {
+        for (size_t i = 0; i < sizeof(vcs) / sizeof(vcs[0]); ++i) {
+            if (strcmp (name, vcs[i]) == 0) return FTW_SKIP_SUBTREE;
+        }
+        return FTW_CONTINUE;
+    }
+    if (type != FTW_F || !((len > 4 && strcmp (name + len - 4, ".nix") == 0) || strcmp (name, "flake.lock") == 0)) {
+        return FTW_CONTINUE;
+    }
+    kb_walk_sum += hash_file (path, st) * KB_FNV_PRIME;
+    return FTW_CONTINUE;
+}
+
+
+/* NIX_PATH is hashed as is, and the entries that are local paths,
+ * `path` or `name=path`, with the store paths they resolve to. Entries
+ * are separated by colons, but URLs have colons of their own.
+ * */
+static uint64_t hash_nix_path (uint64_t key, const char *nixpath) {
+    char path[PATH_MAX];
+
+    key = hash_str (key, nixpath);
+    for (const char *entry = nixpath, *end; *entry != '\0'; entry = *end ? end + 1 : end) {
+        const char *value;
+        for (end = entry; *end != '\0' && (*end != ':' || strncmp (end + 1, "//", 2) == 0); ++end);
+        value = memchr (entry, '=', end - entry);
+        value = value != NULL ? value + 1 : entry;
+        if (*value == '/' && end - value < (ptrdiff_t)sizeof(path)) {
+            memcpy (path, value, end - value);
+            path[end - value] = '\0';
+            key = hash_realpath (key, path);
+        }
+    }
+    return key;
+}
+
+
+/* Hash the inputs of the config `h` would evaluate. This walks the
+ * home-manager directory, so compute it once per refresh and hand it
+ * to `kb_load_config` and the job.
+ * */
+uint64_t kb_config_key (kb_handle *h) {
+    const char *home    = getenv ("HOME");
+    const char *nixpath = getenv ("NIX_PATH");
+    const char *replay  = getenv ("KIRBY_REPLAY");
+    char        path[PATH_MAX];
+    uint64_t    key = KB_FNV_OFFSET;
+
+    if (home != NULL) {
+        snprintf (path, sizeof(path), "%s/.config/home-manager", home);
+        pthread_mutex_lock (&kb_files_lock);
+        kb_walk_sum = 0;
+        nftw (path, walk_file, 16, FTW_PHYS | FTW_ACTIONRETVAL);
+        key = fnv1a (key, &kb_walk_sum, sizeof(kb_walk_sum));
+        pthread_mutex_unlock (&kb_files_lock);
+        snprintf (path, sizeof(path), "%s/.nix-defexpr/channels", home);
+        key = hash_realpath (key, path);
+    }
+    if (nixpath != NULL) key = hash_nix_path (key, nixpath);
+
+    for (char **arg = h->argv; arg != NULL && *arg != NULL; ++arg) key = hash_str (key, *arg);
+    if (replay != NULL) key = hash_str (key, replay);
+    return key;
+}
+
+
+/* The key of a snapshot printed with `:p`, or as JSON. The pool always
+ * prints with `:p`, whatever the handle's `json` says.
+ * */
+static uint64_t snapshot_key (uint64_t key, bool json) {
+    return hash_str (key, json ? KB_JSON_QUERY : KB_CONFIG_QUERY);
+}
+
+
+/* $XDG_CACHE_HOME/kirby/config.snap, or under ~/.cache. */
+static bool kb_snapshot_path (char *path, size_t n) {
+    const char *cache = getenv ("XDG_CACHE_HOME");
+    const char *home  = getenv ("HOME");
+    char        dir[PATH_MAX];
+
+    if (getenv ("KIRBY_NO_CACHE") != NULL) return false;
+    if (cache != NULL && cache[0] != '\0') snprintf (dir, sizeof(dir), "%s", cache);
+    else if (home != NULL) snprintf (dir, sizeof(dir), "%s/.cache", home);
+    else return false;
+
+    mkdir (dir, 0755);
+    strncat (dir, "/kirby", sizeof(dir) - strlen (dir) - 1);
+    if (mkdir (dir, 0755) == -1 && errno != EEXIST) return false;
+    int r = snprintf (path, n, "%s/config.snap", dir);
+    return r >= 0 && (size_t)r < n;
+}
+
+
+/* Load the snapshot of the config into `tree`, if it was saved under
+ * `key`, see `kb_config_key`. Like a job, this releases the previous
+ * tree.
+ *
+ *  @return  0 if the snapshot was loaded, -1 if the config needs to be
+ *           evaluated.
+ * */
+int kb_load_config (kb_handle *h, NixpTree *tree, uint64_t key) {
+    char path[PATH_MAX];
+    arena_rewind (&h->tokpool, h->refresh);
+    if (!kb_snapshot_path (path, sizeof(path))) return -1;
+    return nixp_load (tree, &h->tokpool, path, snapshot_key (key, h->json));
+}
+
+
+/* Stats. Every job times its phases, see `kb_phase`, on the monotonic
+ * clock. The handle keeps the stats of its last job and the rolling
+ * histograms of its config refreshes, and with KIRBY_STATS=file it
+ * appends every job to `file` as a JSON line.
+ * */
+static const char *kb_phase_names[KB_NPHASES] = {
+    "prompt", "eval", "read", "match", "ansi", "parse", "tree", "save", "total",
+};
+
+static const char *kb_query_names[] = { "config", "names", "expand", "value", "paths" };
+
+
+const char *kb_phase_name (kb_phase phase) { return kb_phase_names[phase]; }
+
+
+/* Bucket `b` >= 4 holds [(4 + b % 4), (5 + b % 4)) << (b / 4 - 1) ns,
+ * the ones below it hold their own value.
+ * */
+static unsigned hist_bucket (uint64_t ns) {
+    unsigned l, b;
+    if (ns < 4) return ns;
+    l = 63 - __builtin_clzll (ns);
+    b = l * 4 + ((ns >> (l - 2)) & 3) - 4;
+    return b < KB_STATS_BUCKETS ? b : KB_STATS_BUCKETS - 1;
+}
+
+
+static uint64_t hist_upper (unsigned b) {
+    return b < 4 ? b + 1 : (uint64_t)(5 + b % 4) << (b / 4 - 1);
+}
+
+
+static void hist_add (kb_hist *hist, uint64_t ns) {
+    uint8_t *slot = &hist->ring[hist->n % KB_STATS_WINDOW];
+    if (hist->n >= KB_STATS_WINDOW) hist->count[*slot]--; // the oldest sample leaves the window.
+    *slot = hist_bucket (ns);
+    hist->count[*slot]++;
+    hist->n++;
+}
+
+
+/* The `q` quantile of `phase` over the handle's recent refreshes, in
+ * ns, rounded up to its bucket. 0 before the first refresh.
+ * */
+uint64_t kb_stats_percentile (const kb_handle *h, kb_phase phase, double q) {
+    const kb_hist *hist = &h->hist[phase];
+    unsigned       n    = hist->n < KB_STATS_WINDOW ? hist->n : KB_STATS_WINDOW;
+    uint64_t       rank = q * n, seen = 0;
+
+    if (n == 0) return 0;
+    if (rank < q * n || rank == 0) rank++;
+    for (unsigned b = 0; b < KB_STATS_BUCKETS; ++b) {
+        if ((seen += hist->count[b]) >= rank) return hist_upper (b);
+    }
+    return hist_upper (KB_STATS_BUCKETS - 1);
+}
+
+
+static void stats_log_phases (FILE *fp, const char *name, const kb_handle *h, const uint64_t *ns, double q) {
+    fprintf (fp, ",\"%s\":{", name);
+    for (int i = 0; i < KB_NPHASES; ++i) {
+        fprintf (fp, "%s\"%s\":%" PRIu64, i ? "," : "", kb_phase_names[i], ns ? ns[i] : kb_stats_percentile (h, i, q));
+    }
+    fprintf (fp, "}");
+}
+
+
+/* Append the last job to the log, with the percentiles so far. */
+static void stats_log (kb_handle *h) {
+    const kb_stats *st = &h->stats;
+    fprintf (h->stats_fp, "{\"start\":%" PRId64 ",\"end\":%" PRId64 ",\"kind\":\"%s\",\"status\":%d,"
+             "\"bytes_read\":%zu,\"bytes\":%zu,\"ntoks\":%u",
+             st->start, st->end, kb_query_names[st->kind], st->status, st->bytes_read, st->bytes, st->ntoks);
+    stats_log_phases (h->stats_fp, "ns", h, st->ns, 0);
+    stats_log_phases (h->stats_fp, "p50", h, NULL, 0.5);
+    stats_log_phases (h->stats_fp, "p99", h, NULL, 0.99);
+    fprintf (h->stats_fp, "}\n");
+    fflush (h->stats_fp);
+}
+
+
+/* Account the wait that just ended to `phase`, less the reading and
+ * matching the handle did in it.
+ * */
+static void job_waited (kb_job *job, kb_phase phase) {
+    const struct exp_stats *io    = exp_get_stats (job->h->exp_h);
+    uint64_t                wait  = lap (&job->mark);
+    uint64_t                read  = io->read_ns - job->io.read_ns;
+    uint64_t                match = io->match_ns - job->io.match_ns;
+
+    job->stats.ns[KB_PHASE_READ]  += read;
+    job->stats.ns[KB_PHASE_MATCH] += match;
+    job->stats.ns[phase]          += wait > read + match ? wait - read - match : 0;
+    job->stats.bytes_read         += io->bytes_read - job->io.bytes_read;
+    job->io = *io;
+}
+
+
+/* The job is done or failed: keep its stats on the handle, add a
+ * finished refresh to the histograms and log it.
+ * */
+static void job_finish (kb_job *job) {
+    kb_handle *h  = job->h;
+    kb_stats  *st = &job->stats;
+
+    st->end                 = now_ns ();
+    st->ns[KB_PHASE_TOTAL]  = st->end - st->start;
+    st->status              = kb_job_status (job);
+    if (job->state == KB_JOB_DONE && job->tree != NULL) st->ntoks = job->tree->ntoks;
+    h->stats = *st;
+    if (st->kind == KB_QUERY_CONFIG && st->status == KB_OK) {
+        for (int i = 0; i < KB_NPHASES; ++i) hist_add (&h->hist[i], st->ns[i]);
+    }
+    if (h->stats_fp != NULL) stats_log (h);
+}
+
+
+/* Run `job` again from the first prompt, after it failed. A repl that
+ * died since is respawned first, and bindings evaluated from other
+ * inputs than the job's are defined again. If the respawn fails, so
+ * does the job, with KB_SPAWN.
+ * */
+int kb_job_restart (kb_job *job) {
+    kb_handle *h = job->h;
+    memset (&job->stats, 0, sizeof(job->stats));
+    job->stats.kind  = job->kind;
+    job->stats.start = job->mark = now_ns ();
+    if (!kb_alive (h) && kb_respawn (h) < 0) {
+        job->state = KB_JOB_FAILED;
+        job->error = EXP_ERROR;
+        job_finish (job);
+        return KB_SPAWN;
+    }
+    job->io = *exp_get_stats (h->exp_h);
+    if (job->key != h->key) {
+        kb_forget (h);
+        h->key = job->key;
+    }
+    job->state = KB_JOB_PROMPT;
+    job->cmd   = 0;
+    job->error = EXP_AGAIN;
+    wait_for (job, KB_PROMPT);
+    return KB_OK;
+}
+
+
+static void job_start (kb_job *job, kb_handle *h, NixpTree *tree, kb_query kind, const char *query, uint64_t key) {
+    job->h     = h;
+    job->key   = key;
+    job->tree  = tree;
+    job->kind  = kind;
+    job->query  = query;
+    job->graft  = -1;
+    job->output = NULL;
+    job->size   = 0;
+    job->json   = false;
+    job->defer  = false;
+    kb_job_restart (job);
+}
+
+
+/* Start evaluating the kirby config into `tree`, from the inputs
+ * `key` hashes, see `kb_config_key`. The token pool is rewound to the
+ * handle's savepoint, so the previous tree is released here.
+ * */
+void kb_job_init (kb_job *job, kb_handle *h, NixpTree *tree, uint64_t key) {
+    arena_rewind (&h->tokpool, h->refresh);
+    job_start (job, h, tree, KB_QUERY_CONFIG, h->json ? KB_JSON_QUERY : KB_CONFIG_QUERY, key);
+    job->json = h->json;
+}
+
+
+/* Start a lazy tree: only the names of the config's attributes are
+ * evaluated, their values are thunks for `kb_job_init_expand`. The
+ * previous tree is released like in `kb_job_init`.
+ * */
+void kb_job_init_names (kb_job *job, kb_handle *h, NixpTree *tree, uint64_t key) {
+    arena_rewind (&h->tokpool, h->refresh);
+    job_start (job, h, tree, KB_QUERY_NAMES, KB_NAMES_QUERY, key);
+}
+
+
+/* Append the `n` bytes of `name` as a quoted attribute name, `"a"`, so
+ * any name can be asked for. If `path`, dots separate names, `"a"."b"`.
+ * Needs room for `3 * n + 2` bytes.
+ * */
+static char *quote_attr (char *c, const char *name, size_t n, bool path) {
+    *c++ = '"';
+    for (const char *end = name + n; name < end; ++name) {
+        switch (*name) {
+            case '.':  if (path) c = stpcpy (c, "\".\"");
+                       else *c++ = *name;
+                       break;
+            case '"':
+            case '\\':
+            case '$':  *c++ = '\\'; *c++ = *name; break;
+            default:   *c++ = *name; break;
+        }
+    }
+    *c++ = '"';
+    return c;
+}
+
+
+static char *quote_path (char *c, const char *path) { return quote_attr (c, path, strlen (path), true); }
+
+
+/* `:p <config>.` followed by `name` quoted, on the token pool. */
+static char *value_query (kb_handle *h, const char *name, bool path) {
+    size_t n     = strlen (name);
+    char  *query = arena_alloc (&h->tokpool, strlen (KB_CONFIG_QUERY) + 3 * n + 4);
+    char  *c     = stpcpy (query, KB_CONFIG_QUERY ".");
+    *quote_attr (c, name, n, path) = '\0';
+    return query;
+}
+
+
+/* Start evaluating the value at `path` in the config and graft it over
+ * the thunk `tok` of `tree`, which stays valid meanwhile.
+ * */
+void kb_job_init_expand (kb_job *job, kb_handle *h, NixpTree *tree, int tok, const char *path) {
+    job_start (job, h, tree, KB_QUERY_EXPAND, value_query (h, path, true), h->key);
+    job->graft = tok;
+}
+
+
+/* Start evaluating the values at `n` paths in the config with a single
+ * query. It asks for the set
+ *
+ *   { _0 = if <config> ? "a"."b" then [ <config>."a"."b" ] else [ ]; … }
+ *
+ * so a missing path is an empty list, not an error, and the result is
+ * parsed into `tree` in one go. `kb_path_nodes` finds the values in it.
+ * Like an expansion, this keeps the trees on the token pool.
+ * */
+void kb_job_init_paths (kb_job *job, kb_handle *h, NixpTree *tree, const char *const *paths, int n) {
+    static const char fmt[] = "_%d = if " KB_CONFIG " ? ";
+    size_t            len   = strlen (KB_CONFIG_QUERY) + 8;
+    char             *query, *c;
+
+    for (int i = 0; i < n; ++i) {
+        len += sizeof(fmt) + 2 * strlen (KB_CONFIG) + 32 + 2 * (3 * strlen (paths[i]) + 2);
+    }
+    c = query = arena_alloc (&h->tokpool, len);
+    c = stpcpy (c, ":p { ");
+    for (int i = 0; i < n; ++i) {
+        c += sprintf (c, fmt, i);
+        c  = quote_path (c, paths[i]);
+        c  = stpcpy (c, " then [ " KB_CONFIG ".");
+        c  = quote_path (c, paths[i]);
+        c  = stpcpy (c, " ] else [ ]; ");
+    }
+    stpcpy (c, "}");
+    job_start (job, h, tree, KB_QUERY_PATHS, query, h->key);
+}
+
+
+/* Find the value of each path in the result of `kb_job_init_paths`,
+ * `nodes[i]` for path `i`, -1 if the config has no such path.
+ * */
+void kb_path_nodes (const NixpTree *tree, int n, int *nodes) {
+    const NixpToken *root;
+
+    for (int i = 0; i < n; ++i) nodes[i] = -1;
+    if (tree->ntoks == 0 || (root = nixp_tree_tok (tree, 0))->type != NIX_SET) return;
+
+    // nix sorts the names, `_10` comes before `_2`.
+    for (int k = 0; k < root->size; ++k) {
+        const NixpToken *key = nixp_tree_tok (tree, nixp_tok_get_child (root, k));
+        const NixpToken *list;
+        char            *end;
+        long             i;
+
+        if (key->size != 1 || tree->input[key->start] != '_') continue;
+        i    = strtol (&tree->input[key->start + 1], &end, 10);
+        list = nixp_tree_tok (tree, key->children[0]);
+        if (i < 0 || i >= n || list->type != NIX_LIST || list->size != 1) continue;
+        nodes[i] = list->children[0];
+    }
+}
+
+
+/* Start evaluating the config's attribute `name`, which may contain
+ * dots. The output is left in `job->output` for the caller to parse,
+ * e.g on another thread.
+ * */
+void kb_job_init_value (kb_job *job, kb_handle *h, const char *name) {
+    job_start (job, h, NULL, KB_QUERY_VALUE, value_query (h, name, false), h->key);
+}
+
+
+/* Parse the output of a job's query and put it where it belongs. It
+ * only touches the handle's token pool, see `kb_job_parse`.
+ * */
+static int job_parse (kb_job *job) {
+    kb_handle *h = job->h;
+    char       path[PATH_MAX];
+    NixpTree   sub;
+    int64_t    t;
+
+    if (parse_output (h, job->kind == KB_QUERY_CONFIG || job->kind == KB_QUERY_PATHS ? job->tree : &sub,
+                      job->json, &job->stats) < 0) {
+        job->state = KB_JOB_FAILED;
+        return -1;
+    }
+    t = now_ns ();
+    switch (job->kind) {
+        case KB_QUERY_CONFIG:
+            if (kb_snapshot_path (path, sizeof(path)) && nixp_save (job->tree, path, snapshot_key (job->key, job->json)) < 0) {
+                perror (path); // the tree is fine, the next start evaluates again.
+            }
+            job->stats.ns[KB_PHASE_SAVE] += lap (&t);
+            break;
+        case KB_QUERY_NAMES:
+            if (build_skeleton (h, job->tree, &sub) < 0) job->state = KB_JOB_FAILED;
+            job->stats.ns[KB_PHASE_TREE] += lap (&t);
+            break;
+        case KB_QUERY_EXPAND:
+            if (nixp_graft (job->tree, &job->graft, &sub, 1, &h->tokpool) < 0) {
+                fprintf (stderr, "failed to expand %s\n", job->query);
+                job->state = KB_JOB_FAILED;
+            }
+            job->stats.ns[KB_PHASE_TREE] += lap (&t);
+            break;
+        default:
+            break;
+    }
+    if (job->state == KB_JOB_FAILED) return -1;
+    job->state = KB_JOB_DONE;
+    return 0;
+}
+
+
+static int job_step (kb_job *job, int r) {
+    kb_handle  *h = job->h;
+    const char *cmd;
+    int64_t     t;
+
+    job_waited (job, job->state == KB_JOB_PROMPT ? KB_PHASE_PROMPT : KB_PHASE_EVAL);
+    if (r != 100) {
+        exp_set_keep_buffer (h->exp_h, 0);
+        job->state = KB_JOB_FAILED;
+        job->error = r;
+        if (r == EXP_EOF) kb_respawn (h);
+        return -1;
+    }
+
+    switch (job->state) {
+        case KB_JOB_PROMPT: {
+            /* Type the missing bindings and the query in one go, the
+             * repl reads ahead. Their outputs end at the prompts that
+             * follow, in order.
+             * */
+            const char *cmds[KB_CONFIG_NBINDINGS + 1];
+            int         n = 0;
+            for (cmd = next_cmd (job, 0); cmd != NULL; cmd = next_cmd (job, job->cmd + 1)) cmds[n++] = cmd;
+            if (type_lines (h, cmds, n) < 0) {
+                job->state = KB_JOB_FAILED;
+                job->error = EXP_ERROR;
+                return -1;
+            }
+            next_cmd (job, 0);
+            job->state = KB_JOB_OUTPUT;
+            break;
+        }
+        case KB_JOB_OUTPUT:
+            if (job->cmd < KB_CONFIG_NBINDINGS) {
+                /* A binding is done. It only prints an empty line, unless
+                 * nix failed to evaluate it. Then it stays unbound, the
+                 * query fails on it and the next job defines it again.
+                 * */
+                if (!binding_failed (h)) kb_bind (h, kb_config_bindings[job->cmd].name);
+                next_cmd (job, job->cmd + 1);
+                break;
+            }
+            exp_set_keep_buffer (h->exp_h, 0);
+            leave_prompt (h);
+            for (size_t i = 0; i < KB_CONFIG_NBINDINGS; ++i) {
+                if (!kb_defined (h, kb_config_bindings[i].name)) {
+                    job->state = KB_JOB_FAILED;
+                    job->error = KB_EVAL_ERROR;
+                    return -1;
+                }
+            }
+            if (job->kind == KB_QUERY_VALUE) {
+                t                 = now_ns ();
+                job->output       = copy_output (h, &job->size, true);
+                job->stats.bytes += job->size;
+                job->stats.ns[KB_PHASE_ANSI] += lap (&t);
+                job->state        = KB_JOB_DONE;
+                return 0;
+            }
+            if (job->defer) {
+                job->state = KB_JOB_PARSE;
+                return 2;
+            }
+            return job_parse (job);
+        default:
+            return -1;
+    }
+
+    /* The output of each command is everything before its prompt. Keep
+     * the buffer while waiting so matching only ever rescans the tail.
+     * */
+    exp_set_keep_buffer (h->exp_h, 1);
+    wait_for (job, KB_PROMPT);
+    return 1;
+}
+
+
+/* Advance the job with `r`, the result of expecting `job->wait`.
+ * Returns 1 if `job->wait` should be expected next, 0 once the tree is
+ * built and -1 on failure, with the failing `r` in `job->error`. If
+ * the repl died it is respawned, and the job can be started again.
+ * With `job->defer` set, it returns 2 once the output is in instead of
+ * parsing it, see `kb_job_parse`. The job's stats are kept on the
+ * handle once it ends.
+ * */
+int kb_job_step (kb_job *job, int r) {
+    int s = job_step (job, r);
+    if (s <= 0) job_finish (job);
+    return s;
+}
+
+
+/* Parse the output of a job `kb_job_step` deferred, and end the job.
+ * Only the output left in the expect buffer, the handle's token pool
+ * and the job's tree are touched, so it may run on another thread, as
+ * long as the handle is left alone until it returns. Returns 0 once the tree is built and -1 on failure.
+ * */
+int kb_job_parse (kb_job *job) {
+    int s;
+    if (job->state != KB_JOB_PARSE) return -1;
+    s = job_parse (job);
+    job_finish (job);
+    return s;
+}
+
+
+/* The `kb_status` of a job, KB_OK unless it failed. */
+int kb_job_status (const kb_job *job) {
+    return job->state == KB_JOB_FAILED ? kb_status_of (job->error) : KB_OK;
+}
+
+
+/* Run `job` to the end, blocking. If the repl dies on the way, the job
+ * is run once more on a fresh one.
+ * */
+static int run_job (kb_job *job) {
+    int r;
+    for (int attempt = 0; ; ++attempt) {
+        if (job->state != KB_JOB_FAILED) {
+            while (kb_job_step (job, kb_expect (job->h, job->wait)) > 0);
+        }
+        if (job->state == KB_JOB_DONE) return KB_OK;
+        if (attempt > 0 || job->error != EXP_EOF) return kb_job_status (job);
+        if ((r = kb_job_restart (job)) < 0) return r;
+    }
+}
+
+
+/* Get the values at `n` paths in the config with a single query, see
+ * `kb_job_init_paths`. `nodes[i]` is the value of path `i` in `tree`,
+ * -1 if there is none.
+ *
+ *  @return  KB_OK, or the `kb_status` the query failed with.
+ * */
+int kb_get_paths (kb_handle *h, NixpTree *tree, const char *const *paths, int n, int *nodes) {
+    kb_job job;
+    int    r;
+    kb_job_init_paths (&job, h, tree, paths, n);
+    if ((r = run_job (&job)) < 0) return r;
+    kb_path_nodes (tree, n, nodes);
+    return KB_OK;
+}
+
+
+/* Get the kirby config into `tree`, from the snapshot if it is still
+ * valid, otherwise by evaluating it, blocking until it is done. If the
+ * repl dies on the way, it is tried once more on a fresh one.
+ *
+ *  @return  KB_OK, or the `kb_status` the evaluation failed with.
+ * */
+int kb_get_config (kb_handle *h, NixpTree *tree) {
+    uint64_t key = kb_config_key (h);
+    kb_job   job;
+    if (kb_load_config (h, tree, key) == 0) return KB_OK;
+    kb_job_init (&job, h, tree, key);
+    return run_job (&job);
+}
+
+
+/* Get the skeleton of the kirby config into `tree`, values are filled
+ * in as `kb_access` reaches them. A valid snapshot is complete already
+ * and is used as is.
+ * */
+int kb_get_config_lazy (kb_handle *h, NixpTree *tree) {
+    uint64_t key = kb_config_key (h);
+    kb_job   job;
+    if (kb_load_config (h, tree, key) == 0) return KB_OK;
+    kb_job_init_names (&job, h, tree, key);
+    return run_job (&job);
+}
+
+
+/* Access `path` in `tree` like `nixp_access`, evaluating the thunk on
+ * the way, if there is one. Each value is evaluated whole, so it takes
+ * at most one expansion.
+ *
+ *  @return  the token at `path`, -1 if there is none.
+ * */
+int kb_access (kb_handle *h, NixpTree *tree, const char *path) {
+    char   *prefix = strdup (path);
+    size_t  n      = strlen (path);
+    int     r      = -1;
+    kb_job  job;
+
+    for (size_t i = 0; i <= n; ++i) {
+        if (path[i] != '.' && path[i] != '\0') continue;
+        prefix[i] = '\0';
+        r = nixp_access (tree, prefix);
+        if (r >= 0 && nixp_tree_tok (tree, r)->type == NIX_THUNK) {
+            kb_job_init_expand (&job, h, tree, r, prefix);
+            r = run_job (&job) < 0 ? -1 : nixp_access (tree, prefix);
+        }
+        prefix[i] = path[i];
+        if (r < 0) break;
+    }
+    free (prefix);
+    return r;
+}
+
+
+/* Pools. A single repl evaluates on one core, so a pool splits the
+ * config by its top level attributes and evaluates them on a session
+ * per core. Each output is parsed on a thread of its session while the
+ * repls go on, and the subtrees are grafted into the skeleton at the
+ * end. Sessions are long lived and keep their bindings, like handles.
+ * */
+#define KB_POOL_MAX 64
+
+/* A session of the pool, with the job it runs and its parse thread. */
+typedef struct kb_slot {
+    kb_handle *h;
+    kb_job     job;
+    NixpTree   names;    // the skeleton this session's names job built.
+    int        part;     // the part its value job evaluates.
+    bool       retried;  // the job was restarted on a fresh repl.
+    bool       waiting;  // the job's expect is in the mux.
+    Arena      parse;    // subtrees parsed from the session's outputs.
+    pthread_t  thread;
+    bool       parsing;  // `thread` is to be joined.
+} kb_slot;
+
+
+/* A top level attribute, evaluated on one session and parsed on its
+ * thread. Parts are on the skeleton's token pool, the thread only
+ * writes to its part and its session's parse arena.
+ * */
+typedef struct kb_part {
+    int         at;      // the thunk it replaces.
+    const char *name;    // the attribute, decoded.
+    const char *output;
+    size_t      size;
+    Arena      *arena;
+    NixpTree    tree;
+    int         r;       // nixp_parse result.
+} kb_part;
+
+
+struct kb_pool {
+    Arena   *arena;
+    exp_mux *mux;
+    struct exp_allocator exp_alloc; // the mux's, on `arena`.
+    int      n;
+    kb_slot *slots;
+};
+
+
+/* Create a pool of `n` sessions running `argv` on `arena`, see
+ * `kb_handle_newv`. If `n` is not positive, KIRBY_POOL or the number of
+ * cores is used. Returns NULL if a session could not be started.
+ * */
+kb_pool *kb_pool_new (Arena *arena, int n, char **argv) {
+    const char *env = getenv ("KIRBY_POOL");
+    kb_pool    *pool;
+
+    if (n <= 0) n = env != NULL ? atoi (env) : sysconf (_SC_NPROCESSORS_ONLN);
+    if (n <= 0) n = 1;
+    if (n > KB_POOL_MAX) n = KB_POOL_MAX;
+    if (arena == NULL) arena = arena_thread ();
+
+    pool        = arena_alloc (arena, sizeof(kb_pool));
+    pool->arena = arena;
+    pool->n     = 0;
+    pool->slots = arena_calloc (arena, n, sizeof(kb_slot));
+    pool->exp_alloc = (struct exp_allocator){ kb_exp_malloc, kb_exp_free, kb_exp_realloc, arena };
+    if ((pool->mux = exp_mux_new_alloc (&pool->exp_alloc)) == NULL) {
+        perror ("exp_mux_new");
+        kb_pool_close (pool);
+        return NULL;
+    }
+    for (; pool->n < n; ++pool->n) {
+        if ((pool->slots[pool->n].h = kb_handle_newv (arena, argv)) == NULL) {
+            kb_pool_close (pool);
+            return NULL;
+        }
+        pool->slots[pool->n].h->json = false; // the parts are printed with `:p`.
+        pool->slots[pool->n].parse = arena_new_opts ("parse", &kb_tokpool_opts);
+    }
+    return pool;
+}
+
+
+int kb_pool_size (const kb_pool *pool) { return pool->n; }
+
+
+void kb_pool_close (kb_pool *pool) {
+    if (pool->mux != NULL) exp_mux_free (pool->mux);
+    for (int i = 0; i < pool->n; ++i) {
+        kb_handle_close (pool->slots[i].h);
+        arena_delete (&pool->slots[i].parse);
+    }
+    arena_free (pool->arena, pool->slots);
+    arena_free (pool->arena, pool);
+}
+
+
+static int pool_wait (kb_pool *pool, kb_slot *slot) {
+    if (exp_mux_add (pool->mux, slot->h->exp_h, slot->job.wait, slot->h->match_data) == -1) {
+        perror ("exp_mux_add");
+        return KB_IO;
+    }
+    slot->waiting = true;
+    return KB_OK;
+}
+
+
+static void *parse_part (void *arg) {
+    kb_part   *part = arg;
     NixpParser p;
-    nixp_init(&p);
-    if (nixp_parse(&p, output, size) >= 0) {
-        nixp_tree(tree, &p, output, size);
-        return;
+    nixp_init (&p, part->arena);
+    if ((part->r = nixp_parse (&p, part->output, part->size)) >= 0) {
+        nixp_tree (&part->tree, &p, part->output, part->size);
+    }
+    return NULL;
+}
+
+
+/* Parse the output of `slot`'s value job on its thread. A session's
+ * outputs are parsed one at a time, they share its parse arena.
+ * */
+static void pool_parse (kb_slot *slot, kb_part *part) {
+    if (slot->parsing) pthread_join (slot->thread, NULL);
+    part->output  = slot->job.output;
+    part->size    = slot->job.size;
+    part->arena   = &slot->parse;
+    slot->parsing = pthread_create (&slot->thread, NULL, parse_part, part) == 0;
+    if (!slot->parsing) parse_part (part);
+}
+
+
+/* The parts of the skeleton, one per top level attribute. */
+static kb_part *pool_parts (kb_slot *base, int *n) {
+    const NixpTree  *tree = &base->names;
+    const NixpToken *root;
+    kb_part         *parts;
+
+    *n = 0;
+    if (tree->ntoks == 0 || (root = nixp_tree_tok (tree, 0))->type != NIX_SET) return NULL;
+    parts = arena_calloc (&base->h->tokpool, root->size ? root->size : 1, sizeof(kb_part));
+    for (int i = 0; i < root->size; ++i) {
+        const NixpToken *key  = nixp_tree_tok (tree, nixp_tok_get_child (root, i));
+        size_t           n    = key->end - key->start;
+        char            *name = arena_alloc (&base->h->tokpool, n + 3);
+
+        // keys are nix strings, see `build_skeleton`.
+        name[0] = '"';
+        memcpy (name + 1, &tree->input[key->start], n);
+        name[n + 1] = '"';
+        nixp_unquote (name, n + 2);
+        parts[i].at   = key->children[0];
+        parts[i].name = name;
+    }
+    *n = root->size;
+    return parts;
+}
+
+
+/* Get the kirby config into `tree` like `kb_get_config`, evaluating its
+ * top level attributes in parallel. Every session first asks for the
+ * names of the attributes, defining its bindings on the way, and the
+ * first answer is the skeleton. Then each session takes the next
+ * attribute whenever it is done with one. The tree lives until the
+ * next call.
+ *
+ *  @return  KB_OK, or the `kb_status` of the first failure.
+ * */
+int kb_pool_get_config (kb_pool *pool, NixpTree *tree) {
+    kb_slot *base   = NULL;
+    kb_part *parts  = NULL;
+    int      nparts = 0, next = 0, active = 0;
+    int      status = KB_OK;
+    char     path[PATH_MAX];
+    uint64_t key    = kb_config_key (pool->slots[0].h); // the sessions run the same repl.
+
+    if (kb_load_config (pool->slots[0].h, tree, key) == 0) return KB_OK;
+
+    for (int i = 0; i < pool->n && status == KB_OK; ++i) {
+        kb_slot *slot = &pool->slots[i];
+        arena_clear (&slot->parse);
+        kb_job_init_names (&slot->job, slot->h, &slot->names, key);
+        slot->retried = false;
+        if ((status = kb_job_status (&slot->job)) == KB_OK && (status = pool_wait (pool, slot)) == KB_OK) active++;
+    }
+
+    while (active > 0) {
+        exp_h   *which;
+        kb_slot *slot = NULL;
+        int      r    = exp_mux_wait (pool->mux, exp_get_timeout_ms (pool->slots[0].h->exp_h), &which);
+        if (which == NULL) {
+            fprintf (stderr, "kirby pool: %s\n", r == EXP_TIMEOUT ? "timeout" : strerror (errno));
+            status = kb_status_of (r);
+            break;
+        }
+        for (int i = 0; i < pool->n; ++i) {
+            if (pool->slots[i].h->exp_h == which) slot = &pool->slots[i];
+        }
+        slot->waiting = false;
+
+        switch (kb_job_step (&slot->job, r)) {
+            case 1:
+                if ((r = pool_wait (pool, slot)) == KB_OK) continue;
+                status = r;
+                break;
+            case 0:
+                slot->retried = false;
+                if (slot->job.kind == KB_QUERY_NAMES && base == NULL) {
+                    base  = slot;
+                    if ((parts = pool_parts (base, &nparts)) == NULL) status = KB_PARSE;
+                }
+                if (slot->job.kind == KB_QUERY_VALUE) pool_parse (slot, &parts[slot->part]);
+                break;
+            default:
+                if (slot->job.error == EXP_EOF && !slot->retried) {
+                    // the repl died and was respawned, try once more.
+                    slot->retried = true;
+                    if ((r = kb_job_restart (&slot->job)) == KB_OK && (r = pool_wait (pool, slot)) == KB_OK) continue;
+                    status = r;
+                    break;
+                }
+                status = kb_job_status (&slot->job);
+                break;
+        }
+        active--;
+
+        if (status == KB_OK && base != NULL && next < nparts) {
+            slot->part = next;
+            kb_job_init_value (&slot->job, slot->h, parts[next++].name);
+            if ((status = kb_job_status (&slot->job)) == KB_OK && (status = pool_wait (pool, slot)) == KB_OK) active++;
+        }
+    }
+
+    for (int i = 0; i < pool->n; ++i) {
+        kb_slot *slot = &pool->slots[i];
+        if (slot->waiting) exp_mux_remove (pool->mux, slot->h->exp_h);
+        if (slot->parsing) pthread_join (slot->thread, NULL);
+        slot->waiting = slot->parsing = false;
+    }
+    if (status != KB_OK) return status;
+    if (base == NULL) return KB_PARSE;
+
+    // graft everything at once, the depth map is rebuilt only once.
+    int      *at   = arena_alloc (&base->h->tokpool, sizeof(int) * (nparts + 1));
+    NixpTree *subs = arena_alloc (&base->h->tokpool, sizeof(NixpTree) * (nparts + 1));
+    for (int i = 0; i < nparts; ++i) {
+        if (parts[i].r < 0) {
+            fprintf (stderr, "failed to parse kirby config %s\n", parts[i].name);
+            return KB_PARSE;
+        }
+        at[i]   = parts[i].at;
+        subs[i] = parts[i].tree;
+    }
+    // into a copy, `tree` is only set once the config is whole.
+    NixpTree config = base->names;
+    if (nixp_graft (&config, at, subs, nparts, &base->h->tokpool) < 0) return KB_PARSE;
+    *tree = config;
+    if (kb_snapshot_path (path, sizeof(path)) && nixp_save (tree, path, snapshot_key (base->job.key, false)) < 0) perror (path);
+    return KB_OK;
+}
+
+
+/* Supervisors. A repl that died is replaced by a fresh one, but that
+ * one has to import home-manager and evaluate its modules again before
+ * it answers, which takes seconds on a real config. A supervisor keeps
+ * a standby session that has done so already, warmed on a thread of
+ * its own, and swaps it in when the session fails. The failed session
+ * is closed, and a new standby is warmed in its place.
+ * */
+struct kb_supervisor {
+    Arena     *arena;
+    char     **argv;
+    kb_handle *h;          // the session callers drive.
+    kb_handle *standby;    // warm, or NULL if warming it failed.
+    Arena      arenas[2];  // of the session and the standby, each thread has its own.
+    int        active;     // index of the session's arena.
+    pthread_t  thread;     // warms the standby.
+    bool       warming;    // `thread` is to be joined.
+};
+
+
+/* Start a standby and evaluate the config's names on it, which defines
+ * the bindings and runs the module system. Only the standby's thread
+ * touches it and its arena until it is joined.
+ * */
+static void *warm_standby (void *arg) {
+    kb_supervisor *s = arg;
+    kb_handle     *h = kb_handle_newv (&s->arenas[!s->active], s->argv);
+    NixpTree       names;
+    kb_job         job;
+
+    if (h != NULL) {
+        kb_job_init_names (&job, h, &names, kb_config_key (h));
+        if (run_job (&job) < 0) {
+            fprintf (stderr, "kirby supervisor: standby failed: %s\n", kb_strerror (kb_job_status (&job)));
+            kb_handle_close (h);
+            h = NULL;
+        }
+    }
+    s->standby = h;
+    return NULL;
+}
+
+
+static void supervisor_warm (kb_supervisor *s) {
+    s->arenas[!s->active] = arena_new ("standby");
+    s->standby            = NULL;
+    s->warming            = pthread_create (&s->thread, NULL, warm_standby, s) == 0;
+    if (!s->warming) perror ("pthread_create");
+}
+
+
+/* Create a session running `argv`, see `kb_handle_newv`, and start
+ * warming its standby. The supervisor lives on `arena`, the sessions
+ * on arenas of their own. Returns NULL if the session could not be
+ * started.
+ * */
+kb_supervisor *kb_supervisor_new (Arena *arena, char **argv) {
+    kb_supervisor *s;
+
+    if (arena == NULL) arena = arena_thread ();
+    s             = arena_calloc (arena, 1, sizeof(kb_supervisor));
+    s->arena      = arena;
+    s->argv       = argv;
+    s->arenas[0]  = arena_new ("session");
+    if ((s->h = kb_handle_newv (&s->arenas[0], argv)) == NULL) {
+        arena_delete (&s->arenas[0]);
+        arena_free (arena, s);
+        return NULL;
+    }
+    supervisor_warm (s);
+    return s;
+}
+
+
+void kb_supervisor_close (kb_supervisor *s) {
+    if (s->warming) pthread_join (s->thread, NULL);
+    if (s->standby != NULL) kb_handle_close (s->standby);
+    kb_handle_close (s->h);
+    arena_delete (&s->arenas[0]);
+    arena_delete (&s->arenas[1]);
+    arena_free (s->arena, s);
+}
+
+
+/* The session to drive. It changes on failover. */
+kb_handle *kb_supervisor_handle (kb_supervisor *s) { return s->h; }
+
+
+/* Replace the session with the standby. If the standby is still
+ * warming and `wait` is false, or there is none, the session's repl is
+ * respawned cold instead, and a warming standby is kept for the next
+ * failover. Either way the old repl is killed first, so reaping it
+ * does not wait on a hung one. Trees on the old session's token pool
+ * are released with it.
+ * */
+static kb_handle *supervisor_failover (kb_supervisor *s, bool wait) {
+    // closing the pty reaps the repl, and a hung one may ignore SIGHUP.
+    if (s->h->exp_h != NULL && exp_get_pid (s->h->exp_h) > 0) kill (exp_get_pid (s->h->exp_h), SIGKILL);
+    if (s->warming) {
+        if (wait) {
+            pthread_join (s->thread, NULL);
+        } else if (pthread_tryjoin_np (s->thread, NULL) != 0) {
+            kb_respawn (s->h); // a failed respawn is retried by the next job.
+            return s->h;
+        }
+    }
+    s->warming = false;
+    if (s->standby != NULL && !kb_alive (s->standby)) {
+        kb_handle_close (s->standby);
+        s->standby = NULL;
+    }
+    if (s->standby != NULL) {
+        memcpy (s->standby->hist, s->h->hist, sizeof(s->h->hist)); // the percentiles go on.
+        kb_handle_close (s->h);
+        arena_delete (&s->arenas[s->active]);
+        s->h      = s->standby;
+        s->active = !s->active;
     } else {
-        fprintf(stderr, "failed to parse kirby config");
+        kb_respawn (s->h);
+        arena_delete (&s->arenas[!s->active]);
+    }
+    supervisor_warm (s);
+    return s->h;
+}
+
+
+/* Fail over without blocking, for callers on a main loop: the standby
+ * is swapped in if it is warm, otherwise the session's repl is
+ * respawned cold, see `supervisor_failover`.
+ *
+ *  @return  the session to drive from now on.
+ * */
+kb_handle *kb_supervisor_failover (kb_supervisor *s) { return supervisor_failover (s, false); }
+
+
+/* Get the kirby config into `tree` like `kb_get_config`, but fail over
+ * to the standby, waiting for it if it is still warming, instead of
+ * respawning the repl cold, if the session died since the last call,
+ * and once more if it dies, hangs or fails to talk on the way. A
+ * config that does not parse is not the session's fault and fails as
+ * is.
+ *
+ *  @return  KB_OK, or the `kb_status` the evaluation failed with.
+ * */
+int kb_supervisor_get_config (kb_supervisor *s, NixpTree *tree) {
+    uint64_t key = kb_config_key (s->h);
+    kb_job   job;
+    int      r;
+
+    if (kb_load_config (s->h, tree, key) == 0) return KB_OK;
+    for (int attempt = 0; ; ++attempt) {
+        if (!kb_alive (s->h)) supervisor_failover (s, true); // it died while idle.
+        kb_job_init (&job, s->h, tree, key);
+        if (job.state != KB_JOB_FAILED) {
+            while (kb_job_step (&job, kb_expect (s->h, job.wait)) > 0);
+        }
+        if ((r = kb_job_status (&job)) == KB_OK || r == KB_PARSE || attempt > 0) return r;
+        supervisor_failover (s, true);
     }
 }
@@ -1,16 +1,213 @@
 #pragma once
 
+#include "arena.h"
 #include "expect.h"
 #include "nixp.h"
 
+#define KB_MAX_BINDINGS 16
+
+
+/* Results of the blocking calls. Failures are negative and leave the
+ * handle usable: a repl that died is respawned by the next job, or
+ * swapped for a warm one by a supervisor.
+ * */
+typedef enum kb_status {
+    KB_OK      =  0,
+    KB_EOF     = -1, // the repl died.
+    KB_TIMEOUT = -2, // the repl did not answer in time.
+    KB_IO      = -3, // reading or writing the pty failed, see errno.
+    KB_PCRE    = -4, // matching the output failed.
+    KB_PARSE   = -5, // the output is not a config nixp understands.
+    KB_SPAWN   = -6, // the repl could not be started.
+    KB_EVAL    = -7, // nix failed to evaluate a binding the query needs.
+} kb_status;
+
+
+/* The config, and the commands printing it with `:p` or as JSON.
+ * toJSON can not print functions and would coerce derivations to their
+ * out paths, so they are replaced by the markers `:p` prints for them,
+ * which the JSON front end turns back into their tokens.
+ * */
+#define KB_CONFIG       "hm.config.kirby"
+#define KB_CONFIG_QUERY ":p " KB_CONFIG
+#define KB_JSON_QUERY                                                           \
+    ":p let s = v: "                                                            \
+    "if builtins.isFunction v then \"«lambda»\" "                               \
+    "else if builtins.isAttrs v && v.type or null == \"derivation\" "           \
+    "then \"«derivation ${v.drvPath}»\" "                                       \
+    "else if builtins.isAttrs v then builtins.mapAttrs (n: s) v "               \
+    "else if builtins.isList v then map s v else v; "                           \
+    "in builtins.toJSON (s " KB_CONFIG ")"
+
+
+/* Where the time of a job goes, see `kb_stats`. Reading and matching
+ * interleave with evaluation, so EVAL is the wait for the output less
+ * the time spent reading and matching it.
+ * */
+typedef enum kb_phase {
+    KB_PHASE_PROMPT, // waiting for the first prompt, the repl starting.
+    KB_PHASE_EVAL,   // nix evaluating and printing.
+    KB_PHASE_READ,   // reading the pty.
+    KB_PHASE_MATCH,  // matching prompts in what was read.
+    KB_PHASE_ANSI,   // copying the output out, stripping ansi codes.
+    KB_PHASE_PARSE,  // nixp_parse or nixp_parse_json.
+    KB_PHASE_TREE,   // nixp_tree, and the skeleton or graft on top.
+    KB_PHASE_SAVE,   // writing the snapshot.
+    KB_PHASE_TOTAL,
+    KB_NPHASES,
+} kb_phase;
+
+
+/* What a job evaluates. Lazy trees start from the names of the top
+ * level attributes, each value a thunk that is expanded when needed.
+ * */
+typedef enum kb_query {
+    KB_QUERY_CONFIG, // the whole config, saved as the snapshot.
+    KB_QUERY_NAMES,  // the top level names, values left as thunks.
+    KB_QUERY_EXPAND, // one value, grafted over its thunk.
+    KB_QUERY_VALUE,  // one value, left unparsed in `output`.
+    KB_QUERY_PATHS,  // several values in one set, see `kb_path_nodes`.
+} kb_query;
+
+
+/* Timings and sizes of one job, from its (re)start to its end. */
+typedef struct kb_stats {
+    int64_t  start;            // monotonic ns the job started at.
+    int64_t  end;
+    uint64_t ns[KB_NPHASES];
+    size_t   bytes_read;       // from the pty, echoes and prompts included.
+    size_t   bytes;            // output handed to the parser.
+    unsigned ntoks;
+    kb_query kind;
+    int      status;           // `kb_status` the job ended with.
+} kb_stats;
+
+
+/* Durations of the last KB_STATS_WINDOW refreshes, in buckets four per
+ * power of two of ns, so a percentile is off by at most a quarter.
+ * */
+#define KB_STATS_WINDOW  256
+#define KB_STATS_BUCKETS 160
+
+typedef struct kb_hist {
+    uint32_t count[KB_STATS_BUCKETS];
+    uint8_t  ring[KB_STATS_WINDOW]; // bucket of each sample in the window.
+    unsigned n;                     // samples ever added.
+} kb_hist;
+
+
+/* A long lived `nix repl` session. It remembers which bindings the
+ * repl has, so they are only defined once, and the repl is respawned
+ * if it dies. A handle is bound to the arena it was created on, and
+ * is driven by whichever thread owns that arena. Separate handles
+ * share nothing mutable, so several sessions can run in parallel on
+ * different threads.
+ * */
 typedef struct kb_handle {
-    exp_h            *exp_h;
-    pcre2_match_data *match_data;
+    exp_h                 *exp_h;
+    pcre2_match_data      *match_data;
+    pcre2_general_context *gctx;    // pcre2 allocations go to `arena`.
+    pcre2_compile_context *cctx;
+    pcre2_match_context   *mctx;    // carries `jit_stack` to every match on the handle.
+    pcre2_jit_stack       *jit_stack;
+    Arena                 *arena;   // session memory: handle, expect buffer, pcre2 data.
+    struct exp_allocator   exp_alloc; // expect allocations go to `arena`.
+    Arena                  tokpool; // tokens, trees and the output they point into.
+    ArenaMark              refresh; // token pool savepoint, rewound on every refresh.
+    char                 **argv;    // the repl, NULL for nix. Kept for respawns.
+    const char            *bindings[KB_MAX_BINDINGS]; // names the repl has defined.
+    int                    nbindings;
+    uint64_t               key;     // config inputs the bindings were evaluated from.
+    bool                   json;    // get the whole config as JSON, KIRBY_JSON sets it.
+    kb_stats               stats;   // of the last job.
+    kb_hist                hist[KB_NPHASES]; // of the config refreshes.
+    FILE                  *stats_fp; // KIRBY_STATS=file logs every job, a JSON line each.
 } kb_handle;
 
 
+/* Evaluating the kirby config one expect at a time, for callers that
+ * drive the pty themselves, like a main loop. Expect `wait` on the
+ * handle and hand the result to `kb_job_step`.
+ * */
+typedef enum kb_job_state {
+    KB_JOB_PROMPT, // waiting for the first prompt.
+    KB_JOB_OUTPUT, // waiting for the prompt after the current command's output.
+    KB_JOB_PARSE,  // the output is in, for `kb_job_parse`.
+    KB_JOB_DONE,
+    KB_JOB_FAILED,
+} kb_job_state;
+
+
+typedef struct kb_job {
+    kb_handle   *h;
+    NixpTree    *tree;
+    kb_job_state state;
+    kb_query     kind;
+    const char  *query;   // the command printing the output.
+    bool         json;    // the output is JSON.
+    bool         defer;   // leave the parse to `kb_job_parse`, set after init.
+    int          graft;   // the thunk an expansion replaces.
+    const char  *output;  // output of a value query, on the token pool.
+    size_t       size;
+    size_t       cmd;     // index of the current command.
+    int          error;   // expect result that failed the job, EXP_AGAIN if none did.
+    uint64_t     key;     // config inputs the job evaluates, the snapshot key.
+    kb_stats     stats;
+    int64_t      mark;    // when the current wait started.
+    struct exp_stats io;  // the handle's expect stats at `mark`.
+    exp_regexp   wait[2];
+} kb_job;
+
+
+/* Sessions evaluating the config's top level attributes in parallel,
+ * see `kb_pool_get_config`.
+ * */
+typedef struct kb_pool kb_pool;
+
+
+/* A session with a warm standby, see `kb_supervisor_new`. */
+typedef struct kb_supervisor kb_supervisor;
+
+
 void       kb_init ();
 void       kb_end ();
-kb_handle *kb_handle_new  ();
+kb_handle *kb_handle_new  (Arena *arena);
+kb_handle *kb_handle_newv (Arena *arena, char **argv);
 void       kb_handle_close (kb_handle *);
-void       kb_get_config (kb_handle *h, NixpTree *tree);
+int        kb_get_config (kb_handle *h, NixpTree *tree);
+int        kb_get_config_lazy (kb_handle *h, NixpTree *tree);
+uint64_t   kb_config_key (kb_handle *h);
+int        kb_load_config (kb_handle *h, NixpTree *tree, uint64_t key);
+int        kb_access (kb_handle *h, NixpTree *tree, const char *path);
+int        kb_get_paths (kb_handle *h, NixpTree *tree, const char *const *paths, int n, int *nodes);
+void       kb_path_nodes (const NixpTree *tree, int n, int *nodes);
+bool       kb_alive (kb_handle *h);
+bool       kb_defined (kb_handle *h, const char *name);
+void       kb_forget (kb_handle *h);
+void       kb_job_init (kb_job *job, kb_handle *h, NixpTree *tree, uint64_t key);
+void       kb_job_init_names (kb_job *job, kb_handle *h, NixpTree *tree, uint64_t key);
+void       kb_job_init_expand (kb_job *job, kb_handle *h, NixpTree *tree, int tok, const char *path);
+void       kb_job_init_value (kb_job *job, kb_handle *h, const char *name);
+void       kb_job_init_paths (kb_job *job, kb_handle *h, NixpTree *tree, const char *const *paths, int n);
+int        kb_job_restart (kb_job *job);
+
+kb_pool   *kb_pool_new (Arena *arena, int n, char **argv);
+void       kb_pool_close (kb_pool *pool);
+int        kb_pool_size (const kb_pool *pool);
+int        kb_pool_get_config (kb_pool *pool, NixpTree *tree);
+int        kb_job_step (kb_job *job, int r);
+int        kb_job_parse (kb_job *job);
+int        kb_job_status (const kb_job *job);
+uint64_t   kb_stats_percentile (const kb_handle *h, kb_phase phase, double q);
+const char *kb_phase_name (kb_phase phase);
+const char *kb_strerror (int status);
+
+kb_supervisor *kb_supervisor_new (Arena *arena, char **argv);
+void           kb_supervisor_close (kb_supervisor *s);
+kb_handle     *kb_supervisor_handle (kb_supervisor *s);
+kb_handle     *kb_supervisor_failover (kb_supervisor *s);
+int            kb_supervisor_get_config (kb_supervisor *s, NixpTree *tree);
+
+/* Blocking steps of a session, they return a `kb_status`. */
+int        kb_batch (kb_handle *h, const char *const *cmds, int n, const char **outputs, size_t *sizes);
+size_t     kb_remove_ansii (kb_handle *h, char *dst, const char *src, size_t n);
@@ -1,25 +1,184 @@
 #include <stdio.h>
 #include <gtk/gtk.h>
+#include "expect_glib.h"
 #include "kirby.h"
 
 
-static void activate (GtkApplication *app, gpointer user_data) {
+/* The config is evaluated on the main loop one expect at a time, so
+ * the window keeps drawing while nix is busy. The work that grows with
+ * the config, hashing its inputs, loading the snapshot and parsing the
+ * output, runs on a worker thread, which hands back to the loop from an
+ * idle callback. A session that fails is swapped for the supervisor's
+ * standby if it is warm, otherwise its repl is respawned cold, so
+ * failing over never blocks the loop.
+ * */
+typedef struct App {
+    kb_supervisor *sup;
+    kb_handle     *h;       // the supervisor's session, it changes on failover.
+    kb_job         job;
+    NixpTree       tree;
+    uint64_t       key;     // inputs of the current refresh, see `kb_config_key`.
+    GCancellable  *cancel;
+    guint          pending; // source of the expect in flight, 0 if none.
+    int            retried; // the current refresh was restarted on a new repl.
+    GThread       *worker;  // loading or parsing, the handle is its until joined.
+    int            result;  // of the worker.
+} App;
+
+
+static void refresh (App *app);
+static void evaluate (App *app);
+
+
+/* Join the worker that just finished, false if it was joined on
+ * shutdown already.
+ * */
+static gboolean join_worker (App *app) {
+    if (app->worker == NULL) return FALSE;
+    g_thread_join (app->worker);
+    app->worker = NULL;
+    return TRUE;
+}
+
+
+/* The end of a refresh, `s` from `kb_job_step` or `kb_job_parse`. */
+static void finish (App *app, int s, int r) {
+    if (s == 0) {
+        app->retried = 0;
+        g_print ("kirby config loaded in %.1f ms\n", app->h->stats.ns[KB_PHASE_TOTAL] / 1e6);
+        return;
+    }
+    if (r == EXP_CANCELLED) return;
+    r = kb_job_status (&app->job);
+    if (r != KB_PARSE && r != KB_EVAL && !app->retried) {
+        // the repl died or hung, try once more on a new one.
+        app->retried = 1;
+        app->h       = kb_supervisor_failover (app->sup);
+        refresh (app);
+        return;
+    }
+    app->retried = 0;
+    g_printerr ("failed to load kirby config: %s\n", kb_strerror (r));
+}
+
+
+static gboolean on_parsed (gpointer user_data) {
+    App *app = user_data;
+    if (join_worker (app)) finish (app, app->result, 0);
+    return G_SOURCE_REMOVE;
+}
+
+
+static gpointer parse_config (gpointer user_data) {
+    App *app = user_data;
+    app->result = kb_job_parse (&app->job);
+    g_idle_add (on_parsed, app);
+    return NULL;
+}
+
+
+static void on_config (exp_h *eh, int r, gpointer user_data) {
+    App *app = user_data;
+    int  s;
+    app->pending = 0;
+    switch (s = kb_job_step (&app->job, r)) {
+        case 1:
+            app->pending = exp_expect_async (app->h->exp_h, app->job.wait, app->h->match_data, app->cancel, on_config, app);
+            break;
+        case 2:
+            app->worker = g_thread_new ("kirby-parse", parse_config, app);
+            break;
+        default:
+            finish (app, s, r);
+            break;
+    }
+}
+
+
+static gboolean on_loaded (gpointer user_data) {
+    App *app = user_data;
+    if (!join_worker (app)) return G_SOURCE_REMOVE;
+    if (app->result == 0) g_print ("kirby config loaded from snapshot\n");
+    else evaluate (app);
+    return G_SOURCE_REMOVE;
+}
+
+
+static gpointer load_config (gpointer user_data) {
+    App *app = user_data;
+    app->key    = kb_config_key (app->h);
+    app->result = kb_load_config (app->h, &app->tree, app->key);
+    g_idle_add (on_loaded, app);
+    return NULL;
+}
+
+
+static void evaluate (App *app) {
+    if (!kb_alive (app->h)) app->h = kb_supervisor_failover (app->sup); // it died while idle.
+    kb_job_init (&app->job, app->h, &app->tree, app->key);
+    if (app->job.state == KB_JOB_FAILED) {
+        g_printerr ("failed to load kirby config: %s\n", kb_strerror (kb_job_status (&app->job)));
+        return;
+    }
+    app->job.defer = TRUE;
+    app->pending   = exp_expect_async (app->h->exp_h, app->job.wait, app->h->match_data, app->cancel, on_config, app);
+}
+
+
+/* A retry evaluates on the new repl from the same inputs. */
+static void refresh (App *app) {
+    if (app->retried) evaluate (app);
+    else app->worker = g_thread_new ("kirby-load", load_config, app);
+}
+
+
+static void activate (GtkApplication *gapp, gpointer user_data) {
+    App       *app = user_data;
     GtkWidget *window;
-    window = gtk_application_window_new (app);
+    window = gtk_application_window_new (gapp);
     gtk_window_set_title (GTK_WINDOW (window), "kbgui");
     gtk_window_set_default_size (GTK_WINDOW (window), 200, 200);
     gtk_window_present (GTK_WINDOW (window));
+
+    if (app->sup == NULL) {
+        if ((app->sup = kb_supervisor_new (NULL, NULL)) == NULL) {
+            g_printerr ("failed to start nix repl\n");
+            return;
+        }
+        app->h = kb_supervisor_handle (app->sup);
+        refresh (app);
+    }
+}
+
+
+/* The loop is not run again after shutdown, so the expect in flight
+ * is dropped rather than waited for. A worker is waited for, it holds
+ * the handle.
+ * */
+static void on_shutdown (GtkApplication *gapp, gpointer user_data) {
+    App *app = user_data;
+    g_cancellable_cancel (app->cancel);
+    if (app->pending != 0) g_source_remove (app->pending);
+    app->pending = 0;
+    join_worker (app); // its idle callback finds it joined.
+    if (app->sup != NULL) kb_supervisor_close (app->sup);
+    app->sup = NULL;
+    app->h   = NULL;
 }
 
 
 int main (int argc, char *argv[]) {
-    GtkApplication *app;
+    GtkApplication *gapp;
+    App             app = { 0 };
     int status;
 
-    app = gtk_application_new ("org.kbgui", G_APPLICATION_DEFAULT_FLAGS);
-    g_signal_connect (app, "activate", G_CALLBACK (activate), NULL);
-    status = g_application_run (G_APPLICATION (app), argc, argv);
-    g_print ("Hello");
-    g_object_unref (app);
-    return 0;
+    kb_init ();
+    app.cancel = g_cancellable_new ();
+    gapp = gtk_application_new ("org.kbgui", G_APPLICATION_DEFAULT_FLAGS);
+    g_signal_connect (gapp, "activate", G_CALLBACK (activate), &app);
+    g_signal_connect (gapp, "shutdown", G_CALLBACK (on_shutdown), &app);
+    status = g_application_run (G_APPLICATION (gapp), argc, argv);
+    g_object_unref (gapp);
+    g_object_unref (app.cancel);
+    return status;
 }
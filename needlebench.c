@@ -0,0 +1,98 @@
+/* Compare literal needle search against pcre2 on large buffers.
+ *
+ *   make needlebench && ./needlebench [MiB]
+ *
+ * The haystack is repl-like output with the prompt at the very end,
+ * the worst case for expect, which has to scan all of it.
+ * */
+#define _GNU_SOURCE
+#include "expect.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NEEDLE "nix-repl>"
+#define ROUNDS 10
+
+
+/* Keeps the compiler from hoisting pure calls like memmem out of the
+ * timing loops.
+ * */
+static const char *volatile haystack;
+
+
+static double now_ms () {
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+
+static void report (const char *name, double ms, size_t n) {
+    printf ("%-16s %8.3f ms %9.1f MiB/s\n", name, ms / ROUNDS, (double)n * ROUNDS / (1 << 20) / (ms / 1e3));
+}
+
+
+static void bench_re (const char *name, size_t n, bool jit) {
+    int               errcode;
+    PCRE2_SIZE        erroffset;
+    pcre2_code       *re = pcre2_compile ((PCRE2_SPTR)NEEDLE, PCRE2_ZERO_TERMINATED, 0, &errcode, &erroffset, NULL);
+    pcre2_match_data *md = pcre2_match_data_create (4, NULL);
+    if (jit) pcre2_jit_compile (re, PCRE2_JIT_COMPLETE | PCRE2_JIT_PARTIAL_SOFT);
+
+    double t = now_ms ();
+    for (int i = 0; i < ROUNDS; ++i) {
+        if (pcre2_match (re, (PCRE2_SPTR)haystack, n, 0, PCRE2_PARTIAL_SOFT, md, NULL) < 0) abort ();
+    }
+    report (name, now_ms () - t, n);
+    pcre2_match_data_free (md);
+    pcre2_code_free (re);
+}
+
+
+/* exp_memmem must agree with memmem, including around the vector tails. */
+static void check () {
+    char buf[256];
+    for (int i = 0; i < 100000; ++i) {
+        size_t n = rand () % sizeof(buf);
+        size_t m = 1 + rand () % 12;
+        for (size_t k = 0; k < n; ++k) buf[k] = "ab"[rand () % 2];
+        const char *nd = buf + (n ? rand () % n : 0);
+        if (nd + m > buf + n) nd = "abbaabbaabba"; // as long as the longest needle.
+        if (exp_memmem (buf, n, nd, m) != memmem (buf, n, nd, m)) {
+            fprintf (stderr, "exp_memmem disagrees with memmem\n");
+            exit (EXIT_FAILURE);
+        }
+    }
+}
+
+
+int main (int argc, char **argv) {
+    size_t n   = (argc > 1 ? atol (argv[1]) : 64) << 20;
+    char  *buf = malloc (n);
+    const char *line = "  programs.kirby = { enable = true; settings = { theme = \"dark\"; }; };\n";
+    size_t len = strlen (line);
+
+    check ();
+    for (size_t i = 0; i < n; i += len) memcpy (buf + i, line, n - i < len ? n - i : len);
+    memcpy (buf + n - strlen (NEEDLE), NEEDLE, strlen (NEEDLE));
+    haystack = buf;
+
+    double t = now_ms ();
+    for (int i = 0; i < ROUNDS; ++i) {
+        if (exp_memmem (haystack, n, NEEDLE, strlen (NEEDLE)) == NULL) abort ();
+    }
+    report ("exp_memmem", now_ms () - t, n);
+
+    t = now_ms ();
+    for (int i = 0; i < ROUNDS; ++i) {
+        if (memmem (haystack, n, NEEDLE, strlen (NEEDLE)) == NULL) abort ();
+    }
+    report ("memmem", now_ms () - t, n);
+
+    bench_re ("pcre2_match", n, false);
+    bench_re ("pcre2_match jit", n, true);
+    free (buf);
+}
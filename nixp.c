@@ -1,8 +1,12 @@
 #include <ctype.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "nixp.h"
 #include "arena.h"
 
@@ -31,39 +35,34 @@
  * <key>        ::= <id> | <string>
  */
 
-Arena nixp_tokpool;
-
-
-void nixp_init (NixpParser *p) {
-    nixp_tokpool = arena_new ("tokpool");
+/* Initialize a parser. Tokens, the tree built from them and the tree's
+ * scratch memory are all allocated on `arena`, parsers on different
+ * threads should each use their own.
+ * */
+void nixp_init (NixpParser *p, Arena *arena) {
+    p->arena     = arena;
     p->offset    = 0;
     p->next      = 0;
     p->super     = -1;
-    p->ntoks     = 256;
-    p->pool      = arena_calloc (&nixp_tokpool, p->ntoks, sizeof(NixpToken));
+    arena_vec_init (&p->toks, arena, sizeof(NixpToken), 256);
 }
 
 
-/* Return an unused token. If the pool is full, allocate more space.
- * Reallocation is efficient with arena.
+/* Return an unused token. The pool grows by whole segments, tokens
+ * already handed out are never moved.
  * */
 static NixpToken *tok_alloc (NixpParser *p) {
-    if (p->next >= p->ntoks) {
-        size_t new_ntoks = p->ntoks << 1;
-        if ((p->pool = arena_realloc (&nixp_tokpool, p->pool, new_ntoks)) == NULL) {
-            return NULL;
-        }
-        p->ntoks <<= new_ntoks;
-    }
-
     NixpToken *tok;
-    tok                = &p->pool[p->next++];
+    if ((tok = arena_vec_push (&p->toks)) == NULL) {
+        return NULL;
+    }
+    p->next++;
     tok->start         = -1;
     tok->end           = -1;
     tok->size          = 0;
     tok->parent        = -1;
     tok->more_children = NULL;
-    memset(tok->children, -1, NIXP_TOK_DIRECT);
+    memset(tok->children, -1, sizeof(tok->children));
 
     return tok;
 }
@@ -114,7 +113,7 @@ static int parse_primitive (NixpParser *p, const char *input, size_t size) {
     return NIX_ERR_PARTIAL;
 
 found:
-    if (p->pool == NULL) {
+    if (p->arena == NULL) {
         p->offset--;
         return 0;
     }
@@ -164,6 +163,11 @@ found:
         goto end;
     }
 
+    if (memcmp (&input[start], "«thunk", strlen("«thunk")) == 0) {
+        type = NIX_THUNK;
+        goto end;
+    }
+
     { // check number
         const char *c = &input[start];
         for (;
@@ -255,12 +259,12 @@ int nixp_parse (NixpParser *p, const char *input, size_t size) {
         case '{':
         case '[':
             count++;
-            if (p->pool == NULL)
+            if (p->arena == NULL)
                 break;
             if ((tok = tok_alloc(p)) == NULL)
                 return NIX_ERR_NOMEM;
             if (p->super != -1) {
-                NixpToken *t = &p->pool[p->super];
+                NixpToken *t = nixp_tok(p, p->super);
                 if (t->type == NIX_SET) // set or list can't be key for set.
                     return NIX_ERR_INVALID;
                 t->size++;
@@ -277,7 +281,7 @@ int nixp_parse (NixpParser *p, const char *input, size_t size) {
             break;
         case '}':
         case ']':
-            if (p->pool == NULL)
+            if (p->arena == NULL)
                 break;
 
             if (input[p->offset] == '}')
@@ -290,7 +294,7 @@ int nixp_parse (NixpParser *p, const char *input, size_t size) {
                 return NIX_ERR_INVALID;
             }
 
-            tok = &p->pool[p->next - 1];
+            tok = nixp_tok(p, p->next - 1);
             for (;;) {
                 if (tok->start != -1 && tok->end == -1) { // empty collection
                     if (tok->type != type)
@@ -306,7 +310,7 @@ int nixp_parse (NixpParser *p, const char *input, size_t size) {
                     }
                     break;
                 }
-                tok = &p->pool[tok->parent];
+                tok = nixp_tok(p, tok->parent);
             }
             break;
         case '\"':
@@ -315,7 +319,7 @@ int nixp_parse (NixpParser *p, const char *input, size_t size) {
                 return r;
             count++;
             if (p->super != -1 && tok != NULL) {
-                p->pool[p->super].size++;
+                nixp_tok(p, p->super)->size++;
             }
             break;
         case '\t':
@@ -325,13 +329,15 @@ int nixp_parse (NixpParser *p, const char *input, size_t size) {
             break;
         case '=':
             p->super = p->next - 1;
+            // a quoted name, `"a.b" = …`, is a key like any other.
+            if (p->super >= 0 && nixp_tok(p, p->super)->type == NIX_STRING) nixp_tok(p, p->super)->type = NIX_ID;
             break;
         case ';':
             if (tok != NULL &&
                 p->super != -1 &&
-                p->pool[p->super].type != NIX_SET &&
-                p->pool[p->super].type != NIX_LIST) {
-                p->super = p->pool[p->super].parent;
+                nixp_tok(p, p->super)->type != NIX_SET &&
+                nixp_tok(p, p->super)->type != NIX_LIST) {
+                p->super = nixp_tok(p, p->super)->parent;
             }
             break;
         default:
@@ -340,7 +346,7 @@ int nixp_parse (NixpParser *p, const char *input, size_t size) {
                 return r;
             count++;
             if (p->super != -1 && tok != NULL) {
-                p->pool[p->super].size++;
+                nixp_tok(p, p->super)->size++;
             }
             break;
         }
@@ -348,7 +354,7 @@ int nixp_parse (NixpParser *p, const char *input, size_t size) {
 
     if (tok == NULL) {
         for (int i = p->next - 1; i >= 0; i--) {
-            if (p->pool[i].start != -1 && p->pool[i].end != -1)
+            if (nixp_tok(p, i)->start != -1 && nixp_tok(p, i)->end != -1)
                 return NIX_ERR_PARTIAL;
         }
     }
@@ -357,29 +363,293 @@ int nixp_parse (NixpParser *p, const char *input, size_t size) {
 }
 
 
-void static build_tree_dmap (NixpTree *tree, NixpParser *p, const char *input, size_t size) {
-    tree->dmap = arena_calloc(&nixp_tokpool, sizeof(int), p->ntoks);
+/* JSON front end. `builtins.toJSON` output is tokenized into the same
+ * tokens `nixp_parse` makes, so trees and queries work the same on
+ * both:
+ *
+ *   object          NIX_SET, with a NIX_ID token per key, holding the value
+ *   array           NIX_LIST
+ *   number          NIX_NUMBER, floats and exponents included
+ *   true, false     NIX_BOOLEAN
+ *   null            NIX_NULL
+ *   string          NIX_STRING, the span is inside the quotes
+ *
+ * Strings and keys are decoded in place, so their spans hold the text
+ * itself rather than its escapes, and the spans of the objects and
+ * arrays around them are no longer the JSON verbatim. Values toJSON can not express are
+ * sent as marker strings, see `json_string_type`. Like `nixp_parse`,
+ * it can be called again with more input after NIX_ERR_PARTIAL.
+ * */
+static NixpType json_string_type (const char *s, size_t n) {
+    static const struct { const char *prefix; NixpType type; } markers[] = {
+        { "«lambda", NIX_LAMBDA },
+        { "«primop", NIX_PRIMOP },
+        { "«derivation", NIX_DERIVATION },
+        { "«repeated", NIX_REPEATED },
+    };
+    if (n < strlen("«") || memcmp(s, "«", strlen("«")) != 0) return NIX_STRING;
+    for (size_t i = 0; i < sizeof(markers) / sizeof(markers[0]); ++i) {
+        size_t len = strlen(markers[i].prefix);
+        if (n >= len && memcmp(s, markers[i].prefix, len) == 0) return markers[i].type;
+    }
+    return NIX_STRING;
+}
+
+
+static int json_hex4 (const char *s) {
+    int v = 0;
+    for (int i = 0; i < 4; ++i) {
+        char c = s[i];
+        if (c >= '0' && c <= '9') v = v * 16 + c - '0';
+        else if (c >= 'a' && c <= 'f') v = v * 16 + c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v = v * 16 + c - 'A' + 10;
+        else return -1;
+    }
+    return v;
+}
+
+
+/* Decode the escapes of the string in s[0 .. n) in place, \uXXXX as
+ * UTF-8, a surrogate pair as one code point. Decoding never grows the
+ * string.
+ *
+ *  @return  the decoded size, or NIX_ERR_INVALID on a bad escape.
+ * */
+static int json_unescape (char *s, size_t n) {
+    char *out = s, *end = s + n;
+
+    for (char *c = s; c < end; ++c) {
+        long u, lo;
+        if (*c != '\\') {
+            *out++ = *c;
+            continue;
+        }
+        if (++c == end) return NIX_ERR_INVALID;
+        switch (*c) {
+        case 'b': *out++ = '\b'; continue;
+        case 'f': *out++ = '\f'; continue;
+        case 'n': *out++ = '\n'; continue;
+        case 'r': *out++ = '\r'; continue;
+        case 't': *out++ = '\t'; continue;
+        case '"':
+        case '\\':
+        case '/': *out++ = *c; continue;
+        case 'u': break;
+        default:  return NIX_ERR_INVALID;
+        }
+        if (end - c < 5 || (u = json_hex4(c + 1)) < 0) return NIX_ERR_INVALID;
+        c += 4;
+        if (u >= 0xd800 && u < 0xdc00) { // high surrogate, the low one follows.
+            if (end - c < 7 || c[1] != '\\' || c[2] != 'u') return NIX_ERR_INVALID;
+            if ((lo = json_hex4(c + 3)) < 0xdc00 || lo >= 0xe000) return NIX_ERR_INVALID;
+            u  = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+            c += 6;
+        } else if (u >= 0xdc00 && u < 0xe000) {
+            return NIX_ERR_INVALID;
+        }
+        if (u < 0x80) {
+            *out++ = u;
+        } else if (u < 0x800) {
+            *out++ = 0xc0 | u >> 6;
+            *out++ = 0x80 | (u & 0x3f);
+        } else if (u < 0x10000) {
+            *out++ = 0xe0 | u >> 12;
+            *out++ = 0x80 | (u >> 6 & 0x3f);
+            *out++ = 0x80 | (u & 0x3f);
+        } else {
+            *out++ = 0xf0 | u >> 18;
+            *out++ = 0x80 | (u >> 12 & 0x3f);
+            *out++ = 0x80 | (u >> 6 & 0x3f);
+            *out++ = 0x80 | (u & 0x3f);
+        }
+    }
+    return out - s;
+}
+
+
+/* Add a token for the value or key in `start` to `end` under the
+ * current container. A key becomes the container until its value is
+ * done.
+ * */
+static int json_token (NixpParser *p, NixpType type, int start, int end) {
+    NixpToken *tok, *super = p->super == -1 ? NULL : nixp_tok(p, p->super);
+
+    if (super != NULL && super->type == NIX_ID && super->size == 1)
+        return NIX_ERR_INVALID; // two values for one key.
+    if (super != NULL && (super->type == NIX_SET) != (type == NIX_ID))
+        return NIX_ERR_INVALID; // objects hold keys, keys hold values.
+    if ((tok = tok_alloc(p)) == NULL)
+        return NIX_ERR_NOMEM;
+
+    tok_set(tok, type, start, end);
+    tok->parent = p->super;
+    if (super != NULL)
+        super->size++;
+    if (type == NIX_ID)
+        p->super = p->next - 1;
+    return 0;
+}
+
+
+int nixp_parse_json (NixpParser *p, char *input, size_t size) {
+    NixpToken *tok;
+    int        r;
+    int        start;
+    int        len;
+    int        count = p->next;
 
+    for (; p->offset < size && input[p->offset] != '\0'; ++p->offset) {
+        char c = input[p->offset];
+        switch (c) {
+        case '{':
+        case '[':
+            if ((r = json_token(p, c == '{' ? NIX_SET : NIX_LIST, p->offset, -1)) < 0)
+                return r;
+            p->super = p->next - 1;
+            count++;
+            break;
+        case '}':
+        case ']':
+            if (p->super == -1)
+                return NIX_ERR_INVALID;
+            tok = nixp_tok(p, p->super);
+            if (tok->type == NIX_ID) // the last member is done.
+                tok = nixp_tok(p, tok->parent);
+            if (tok->type != (c == '}' ? NIX_SET : NIX_LIST) || tok->end != -1)
+                return NIX_ERR_INVALID;
+            tok->end = p->offset + 1;
+            p->super = tok->parent;
+            break;
+        case '"':
+            start = p->offset++;
+            for (; p->offset < size && input[p->offset] != '"'; ++p->offset) {
+                if (input[p->offset] == '\\') p->offset++;
+            }
+            if (p->offset >= size) {
+                p->offset = start;
+                return NIX_ERR_PARTIAL;
+            }
+            if ((len = json_unescape(&input[start + 1], p->offset - start - 1)) < 0)
+                return len;
+            if (p->super != -1 && nixp_tok(p, p->super)->type == NIX_SET)
+                r = json_token(p, NIX_ID, start + 1, start + 1 + len);
+            else
+                r = json_token(p, json_string_type(&input[start + 1], len), start + 1, start + 1 + len);
+            if (r < 0)
+                return r;
+            count++;
+            break;
+        case ',':
+            if (p->super != -1 && nixp_tok(p, p->super)->type == NIX_ID)
+                p->super = nixp_tok(p, p->super)->parent;
+            break;
+        case ':':
+        case '\t':
+        case '\r':
+        case '\n':
+        case ' ':
+            break;
+        default:
+            start = p->offset;
+            for (; p->offset < size; ++p->offset) {
+                c = input[p->offset];
+                if (c == ',' || c == '}' || c == ']' || c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\0')
+                    break;
+            }
+            if (p->offset >= size && p->super != -1) { // more digits may follow.
+                p->offset = start;
+                return NIX_ERR_PARTIAL;
+            }
+            switch (input[start]) {
+            case 't':
+            case 'f': r = json_token(p, NIX_BOOLEAN, start, p->offset); break;
+            case 'n': r = json_token(p, NIX_NULL, start, p->offset); break;
+            case '-':
+            case '0' ... '9': r = json_token(p, NIX_NUMBER, start, p->offset); break;
+            default:  r = NIX_ERR_INVALID; break;
+            }
+            if (r < 0)
+                return r;
+            count++;
+            p->offset--;
+            break;
+        }
+    }
+
+    for (int i = p->next - 1; i >= 0; i--) {
+        if (nixp_tok(p, i)->end == -1)
+            return NIX_ERR_PARTIAL; // unclosed object or array.
+    }
+    return count;
+}
+
+
+/* Decode the nix string literal the repl prints, `"…"`, in place and
+ * return the decoded size. Input without quotes is left as is.
+ * */
+size_t nixp_unquote (char *s, size_t n) {
+    char *begin = memchr(s, '"', n);
+    char *end   = s + n;
+    char *out   = s;
+
+    if (begin == NULL) return n;
+    while (end > begin + 1 && end[-1] != '"') end--;
+    if (end == begin + 1) return n;
+    end--; // closing quote.
+
+    for (char *c = begin + 1; c < end; ++c) {
+        if (*c != '\\' || c + 1 == end) {
+            *out++ = *c;
+            continue;
+        }
+        switch (*++c) {
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        default:  *out++ = *c; break; // \" \\ \$
+        }
+    }
+    *out = '\0';
+    return out - s;
+}
+
+
+void static build_tree_dmap (NixpTree *tree, Arena *arena) {
     // build dcount.
-    unsigned        *dcount = NULL; // number of elements per depth
+    ArenaVec         dvec;          // number of elements per depth
+    unsigned        *dcount = NULL;
     const NixpToken *tok    = NULL;
-    size_t           ndepth = 1;     // size of dmap
+    size_t           ndepth;        // size of dmap
     size_t           d;             // current depth index
     int              i;
+
+    arena_vec_init(&dvec, arena, sizeof(unsigned), 16);
+    *(unsigned *)arena_vec_push(&dvec) = 0;
     for (i = 0; i < tree->ntoks; ++i) {
-        tok = &tree->tree[i];
+        tok = nixp_tree_tok(tree, i);
         d   = 0;
 
         while (tok->parent != -1) {
-            tok = &tree->tree[tok->parent];
+            tok = nixp_tree_tok(tree, tok->parent);
             d++;
         }
 
-        ndepth = d + 1 >= ndepth ? d + 1 : ndepth;
-        dcount = arena_realloc(&nixp_tokpool, dcount, ndepth * sizeof(unsigned));
-        dcount[d]++;
+        while (dvec.len < d + 1) {
+            *(unsigned *)arena_vec_push(&dvec) = 0;
+        }
+        (*(unsigned *)arena_vec_at(&dvec, d))++;
+    }
+
+    // the depth is small, flatten the counts for indexed access.
+    ndepth = dvec.len;
+    dcount = arena_alloc(arena, ndepth * sizeof(unsigned));
+    for (d = 0; d < ndepth; ++d) {
+        dcount[d] = *(unsigned *)arena_vec_at(&dvec, d);
     }
 
+    // dmap holds `ndepth` entry pointers followed by the entries.
+    tree->dmap = arena_alloc(arena, sizeof(int *) * ndepth + sizeof(int) * tree->ntoks);
+
     // build dmap offset.
     unsigned off = 0;
     for (int i = 0; i < ndepth; ++i) {
@@ -392,10 +662,10 @@ void static build_tree_dmap (NixpTree *tree, NixpParser *p, const char *input, s
 
     // second pass to assign entries.
     for (i = 0; i < tree->ntoks; ++i) {
-        tok = &tree->tree[i];
+        tok = nixp_tree_tok(tree, i);
         d   = 0;
         while (tok->parent != -1) {
-            tok = &tree->tree[tok->parent];
+            tok = nixp_tree_tok(tree, tok->parent);
             d++;
         }
         tree->dmap[d][dcount[d]++] = i;
@@ -414,13 +684,13 @@ static void build_tree_children (NixpTree *tree, NixpParser *p, const char *inpu
 
     NixpToken *tok;
     NixpToken *parent;
-    int       *nchildren_map = calloc(tree->ntoks, sizeof(unsigned)); // save number of children found so far.
+    int       *nchildren_map = arena_calloc(p->arena, tree->ntoks, sizeof(unsigned)); // save number of children found so far.
     // loop over the tree bottom up. Ingore leaves and root.
     for (unsigned d = tree->ndepth - 1; d > 0; d--) {
         for (unsigned i = 0; i < tree->dsize[d]; ++i) {
             int tokid = tree->dmap[d][i];
-            tok       = &tree->tree[tokid];
-            parent    = &tree->tree[tok->parent];
+            tok       = nixp_tree_tok(tree, tokid);
+            parent    = nixp_tree_tok(tree, tok->parent);
 
             assert(nchildren_map[tok->parent] >= 0);
 
@@ -433,39 +703,28 @@ static void build_tree_children (NixpTree *tree, NixpParser *p, const char *inpu
                 goto next;
             } else {
                 // indirect child
-                unsigned      nthblk = (cidx - NIXP_TOK_DIRECT) / NIXP_TOK_INDIRECT;
-                unsigned      offset = (cidx - NIXP_TOK_DIRECT) % NIXP_TOK_INDIRECT;
-                NixpChildren *blkp   = parent->more_children;
-                for (unsigned n = nthblk; n >= 0; --n) {
-                    if (blkp == NULL && n == 0) { // allocate
-                            blkp = arena_alloc(&nixp_tokpool, sizeof(NixpChildren));
-                            blkp->children[offset] = tokid;
-                            parent->more_children = blkp;
-                            goto next;
-                    }
-
-                    if (blkp == NULL) {
+                unsigned       nthblk = (cidx - NIXP_TOK_DIRECT) / NIXP_TOK_INDIRECT;
+                unsigned       offset = (cidx - NIXP_TOK_DIRECT) % NIXP_TOK_INDIRECT;
+                NixpChildren **link   = &parent->more_children;
+                for (unsigned n = 0; n < nthblk; ++n) {
+                    if (*link == NULL) {
                         fprintf(stderr, "expecting token block");
                         exit(EXIT_FAILURE);
                     }
+                    link = &(*link)->next;
+                }
 
-                    if (n == 0) {
-                        blkp->children[offset] = tokid;
-                        goto next;
-                    }
-
-                    if (n > 0) {
-                        blkp = blkp->next;
-                        continue;
-                    }
+                if (*link == NULL) { // allocate
+                    *link = arena_calloc(p->arena, 1, sizeof(NixpChildren));
                 }
+                (*link)->children[offset] = tokid;
             }
 
         next:
             nchildren_map[tok->parent] = new_nchildren;
         }
     }
-    free(nchildren_map); //  free the scratch memory.
+    arena_free(p->arena, nchildren_map); //  free the scratch memory.
 }
 
 
@@ -503,10 +762,11 @@ int nixp_tok_get_child(const NixpToken *tok, unsigned nth) {
 
 /* Build a nixp tree */
 void nixp_tree (NixpTree *tree, NixpParser *p, const char *input, size_t size) {
-    tree->tree  = p->pool;
+    tree->toks  = p->toks;
     tree->ntoks = p->next;
     tree->input = input;
     tree->size  = size;
+    tree->cap   = 0;
 
     if (tree->size == 0) { // empty tree
         tree->ndepth = 0;
@@ -515,7 +775,7 @@ void nixp_tree (NixpTree *tree, NixpParser *p, const char *input, size_t size) {
         return;
     }
 
-    build_tree_dmap (tree, p, input, size);
+    build_tree_dmap (tree, p->arena);
     build_tree_children (tree, p, input, size);
 }
 
@@ -539,6 +799,7 @@ static void nixp_dump_token(FILE *fp, const NixpToken *tok, int toknum, const ch
     case NIX_DERIVATION: type = "NIX_DERIVATION"; break;
     case NIX_ELLIPSIS:   type = "NIX_ELLIPSIS"; break;
     case NIX_NULL:       type = "NIX_NULL"; break;
+    case NIX_THUNK:      type = "NIX_THUNK"; break;
     }
 
     fprintf (fp, "TOKEN %d\n", toknum);
@@ -559,7 +820,7 @@ static void nixp_dump_token(FILE *fp, const NixpToken *tok, int toknum, const ch
 
 void nixp_dump(FILE *fp, NixpTree *tree) {
     for (int i = 0; i < tree->ntoks; ++i) {
-        nixp_dump_token (fp, &tree->tree[i], i, tree->input, tree->size);
+        nixp_dump_token (fp, nixp_tree_tok(tree, i), i, tree->input, tree->size);
     }
 }
 
@@ -589,12 +850,12 @@ int nixp_tok_search (const NixpToken *tok, const NixpTree *tree, const char **pa
         NixpToken *child;
         for (int i = 0; i < tok->size; ++i) {
             int cid = nixp_tok_get_child(tok, i);
-            child = &tree->tree[cid];
+            child = nixp_tree_tok(tree, cid);
             if (nixp_tok_cmp(child, tree, path[0], strlen(path[0])) == 0) {
-                break;
+                return nixp_tok_search(child, tree, ++path, --npath);
             }
         }
-        return nixp_tok_search(child, tree, ++path, --npath);
+        return -1; // no such member.
     }
 
     if (tok->type ==  NIX_ID) {
@@ -603,7 +864,7 @@ int nixp_tok_search (const NixpToken *tok, const NixpTree *tree, const char **pa
             return -1;
         }
 
-        child = &tree->tree[tok->children[0]];
+        child = nixp_tree_tok(tree, tok->children[0]);
         return nixp_tok_search(child, tree, path, npath);
     }
 
@@ -622,20 +883,361 @@ int nixp_access (NixpTree *tree, const char *path) {
     char  *buffer    = NULL;
     char **path_list = NULL;
     char  *endptr    = NULL;
-    buffer = malloc(sizeof(char) * n);
-    strncpy(buffer, path, n);
+    buffer = malloc(sizeof(char) * (n + 1));
+    memcpy(buffer, path, n + 1);
 
     int pi = 0;
     for (char *t = strtok_r (buffer, ".", &endptr);
          t != NULL;
          t = strtok_r (0, ".", &endptr), pi++) {
-        path_list    = realloc(path_list, sizeof(char *) * pi + 1);
+        path_list    = realloc(path_list, sizeof(char *) * (pi + 1));
         path_list[pi] = t;
     }
 
-    r = nixp_tok_search(&tree->tree[0], tree, (const char **)path_list, pi);
+    r = nixp_tok_search(nixp_tree_tok(tree, 0), tree, (const char **)path_list, pi);
 
     free(buffer);
     free(path_list);
     return r;
 }
+
+
+/* Graft `sub` over the token `at` of `tree`, usually a thunk standing
+ * in for a value that was not evaluated. The root of `sub` takes the
+ * place of `at`, so its parent still finds it, the rest of the tokens
+ * are appended. The input of `sub` is copied to the end of the tree's
+ * input, which the tree then owns and grows in place on later grafts.
+ * */
+static bool graft_valid (const NixpTree *tree, int at, const NixpTree *sub) {
+    if (sub->ntoks == 0 || at < 0 || (unsigned)at >= tree->ntoks) return false;
+    for (unsigned i = 1; i < sub->ntoks; ++i) {
+        if (nixp_tree_tok(sub, i)->parent == -1) return false;
+    }
+    return true;
+}
+
+
+static void graft (NixpTree *tree, int at, NixpTree *sub, Arena *arena) {
+    unsigned base = tree->ntoks - 1; // sub token i > 0 becomes base + i.
+    int      off  = tree->size;
+
+    memcpy((char *)tree->input + tree->size, sub->input, sub->size);
+    tree->size += sub->size;
+
+#define GRAFT_ID(i) ((i) == 0 ? at : (int)(base + (i)))
+    for (unsigned i = 0; i < sub->ntoks; ++i) {
+        NixpToken *src = nixp_tree_tok(sub, i);
+        NixpToken *dst = i == 0 ? nixp_tree_tok(tree, at) : arena_vec_push(&tree->toks);
+
+        dst->type          = src->type;
+        dst->start         = src->start == -1 ? -1 : src->start + off;
+        dst->end           = src->end == -1 ? -1 : src->end + off;
+        dst->size          = src->size;
+        dst->more_children = src->more_children;
+        if (i > 0) dst->parent = GRAFT_ID(src->parent);
+        for (int c = 0; c < NIXP_TOK_DIRECT; ++c) {
+            dst->children[c] = src->children[c] == -1 ? -1 : GRAFT_ID(src->children[c]);
+        }
+        int c = NIXP_TOK_DIRECT;
+        for (NixpChildren *blk = dst->more_children; blk != NULL; blk = blk->next) {
+            for (int k = 0; k < NIXP_TOK_INDIRECT && c < dst->size; ++k, ++c) {
+                blk->children[k] = GRAFT_ID(blk->children[k]);
+            }
+        }
+    }
+#undef GRAFT_ID
+    tree->ntoks += sub->ntoks - 1;
+}
+
+
+/* Graft each of the `n` trees in `subs` over the token of `tree` in
+ * `at`, see `graft`. The depth map is rebuilt once, at the end.
+ *
+ * `subs` are consumed, their children blocks are moved to the tree, so
+ * the arenas they are on must live as long as the tree. The tree's
+ * input and tokens grow on `arena`.
+ *
+ * Every graft is checked before the tree is touched, so on failure
+ * the tree is left as it was.
+ *
+ *  @return  0 on success, -1 if a tree in `subs` is not a single value,
+ *           a token in `at` is not in the tree, or the tree could not
+ *           grow.
+ * */
+int nixp_graft (NixpTree *tree, const int *at, NixpTree *subs, unsigned n, Arena *arena) {
+    size_t size  = tree->size;
+    size_t ntoks = 0;
+    char  *input;
+
+    for (unsigned i = 0; i < n; ++i) {
+        if (!graft_valid(tree, at[i], &subs[i])) return -1;
+        size  += subs[i].size;
+        ntoks += subs[i].ntoks - 1;
+    }
+    if (!arena_vec_reserve(&tree->toks, ntoks)) return -1; // the pushes in `graft` can not fail.
+
+    if (size > tree->cap) {
+        size_t cap = 2 * size;
+        if (tree->cap > 0) {
+            input = arena_realloc(arena, (char *)tree->input, cap);
+        } else if ((input = arena_alloc(arena, cap)) != NULL) {
+            memcpy(input, tree->input, tree->size);
+        }
+        if (input == NULL) return -1;
+        tree->input = input;
+        tree->cap   = cap;
+    }
+
+    for (unsigned i = 0; i < n; ++i) graft(tree, at[i], &subs[i], arena);
+    build_tree_dmap (tree, arena); // depths below the grafts changed.
+    return 0;
+}
+
+
+/* Snapshots. A tree is saved with everything needed to use it again
+ * without parsing: the input, the tokens with their children, and the
+ * depth map. Sections are 8 byte aligned, in this order:
+ *
+ *   NixpSnapHeader
+ *   input                   `size` bytes
+ *   NixpSnapTok             `ntoks` of them
+ *   indirect children       `nmore` ints, the children past the direct
+ *                           ones of each token in turn
+ *   dsize                   `ndepth` unsigned
+ *   dmap entries            `ntoks` ints, depth by depth
+ *
+ * The format is native endian, snapshots are a local cache.
+ * */
+#define NIXP_SNAP_MAGIC "nixpsnp1"
+
+typedef struct {
+    char     magic[8];
+    uint64_t key;
+    uint64_t size;
+    uint64_t nmore;
+    uint32_t ntoks;
+    uint32_t ndepth;
+} NixpSnapHeader;
+
+
+typedef struct {
+    int32_t type;
+    int32_t start;
+    int32_t end;
+    int32_t size;
+    int32_t parent;
+    int32_t children[NIXP_TOK_DIRECT];
+} NixpSnapTok;
+
+
+static inline size_t snap_pad (size_t n) { return (n + 7) & ~(size_t)7; }
+
+
+static size_t snap_nmore (const NixpTree *tree) {
+    size_t n = 0;
+    for (unsigned i = 0; i < tree->ntoks; ++i) {
+        int size = nixp_tree_tok(tree, i)->size;
+        if (size > NIXP_TOK_DIRECT) n += size - NIXP_TOK_DIRECT;
+    }
+    return n;
+}
+
+
+// pad a section of `n` bytes to the next 8 byte boundary.
+static bool snap_align (FILE *fp, size_t n) {
+    static const char zero[8];
+    return fwrite(zero, 1, snap_pad(n) - n, fp) == snap_pad(n) - n;
+}
+
+
+static bool snap_write (FILE *fp, const void *p, size_t n) {
+    return fwrite(p, 1, n, fp) == n && snap_align(fp, n);
+}
+
+
+/* Save `tree` to `path` under `key`. The file is replaced atomically,
+ * readers never see a partial snapshot. Each save writes a file of its
+ * own first, so concurrent saves do not mix, the last rename wins.
+ *
+ *  @return  0 on success, -1 on errors.
+ * */
+int nixp_save (const NixpTree *tree, const char *path, uint64_t key) {
+    NixpSnapHeader hdr = { .key = key, .size = tree->size, .nmore = snap_nmore(tree),
+                           .ntoks = tree->ntoks, .ndepth = tree->ndepth };
+    char           tmp[4096];
+    FILE          *fp;
+    bool           ok;
+    int            fd, n;
+
+    memcpy(hdr.magic, NIXP_SNAP_MAGIC, sizeof(hdr.magic));
+    n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    if (n < 0 || (size_t)n >= sizeof(tmp)) return -1;
+    if ((fd = mkstemp(tmp)) == -1) return -1;
+    if ((fp = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    ok = snap_write(fp, &hdr, sizeof(hdr)) && snap_write(fp, tree->input, tree->size);
+    for (unsigned i = 0; ok && i < tree->ntoks; ++i) {
+        const NixpToken *tok = nixp_tree_tok(tree, i);
+        NixpSnapTok      st  = { tok->type, tok->start, tok->end, tok->size, tok->parent };
+        memcpy(st.children, tok->children, sizeof(st.children));
+        ok = fwrite(&st, sizeof(st), 1, fp) == 1;
+    }
+    for (unsigned i = 0; ok && i < tree->ntoks; ++i) {
+        const NixpToken *tok = nixp_tree_tok(tree, i);
+        for (int c = NIXP_TOK_DIRECT; ok && c < tok->size; ++c) {
+            int32_t child = nixp_tok_get_child(tok, c);
+            ok = fwrite(&child, sizeof(child), 1, fp) == 1;
+        }
+    }
+    // tokens and indirect children are padded together.
+    ok = ok && snap_align(fp, sizeof(NixpSnapTok) * tree->ntoks + sizeof(int32_t) * hdr.nmore);
+    ok = ok && snap_write(fp, tree->dsize, sizeof(unsigned) * tree->ndepth);
+    for (unsigned d = 0; ok && d < tree->ndepth; ++d) {
+        ok = fwrite(tree->dmap[d], sizeof(int), tree->dsize[d], fp) == tree->dsize[d];
+    }
+
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+
+static bool snap_index (int32_t i, uint32_t ntoks) { return i >= 0 && (uint32_t)i < ntoks; }
+
+
+/* Whether a snapshot is a tree nixp can use, so loading it never reads
+ * past the file and using it never reads past the tree: the indirect
+ * children add up to `nmore` and the depth map to `ntoks` entries, the
+ * spans are in the input, and every parent, child and depth map entry
+ * is a token. Unused child slots are -1.
+ * */
+static bool snap_valid (const NixpSnapHeader *hdr, const NixpSnapTok *stoks,
+                        const unsigned *dsize, const int *dmap) {
+    const int32_t *more = (const int32_t *)(stoks + hdr->ntoks);
+    size_t         nmore = 0, ndmap = 0;
+
+    for (unsigned i = 0; i < hdr->ntoks; ++i) {
+        const NixpSnapTok *st = &stoks[i];
+        if (st->type < NIX_UNKNOWN || st->type > NIX_THUNK || st->size < 0) return false;
+        if (st->start < -1 || st->end < -1) return false;
+        if (st->start != -1 && (uint64_t)st->start > hdr->size) return false;
+        if (st->end != -1 && ((uint64_t)st->end > hdr->size || st->end < st->start)) return false;
+        if (st->parent != -1 && !snap_index(st->parent, hdr->ntoks)) return false;
+        for (int c = 0; c < NIXP_TOK_DIRECT; ++c) {
+            if (c < st->size ? !snap_index(st->children[c], hdr->ntoks) : st->children[c] != -1) return false;
+        }
+        if (st->size > NIXP_TOK_DIRECT) nmore += st->size - NIXP_TOK_DIRECT;
+    }
+    if (nmore != hdr->nmore) return false;
+    for (size_t i = 0; i < nmore; ++i) {
+        if (!snap_index(more[i], hdr->ntoks)) return false;
+    }
+    for (unsigned d = 0; d < hdr->ndepth; ++d) ndmap += dsize[d];
+    if (ndmap != hdr->ntoks) return false;
+    for (size_t i = 0; i < ndmap; ++i) {
+        if (!snap_index(dmap[i], hdr->ntoks)) return false;
+    }
+    return true;
+}
+
+
+/* Load the snapshot at `path` into `tree`, if it was saved under
+ * `key`. The file is read into `arena` in one go and the tree points
+ * into it, only the tokens are rebuilt.
+ *
+ *  @return  0 on success, -1 if there is no valid snapshot for `key`.
+ * */
+int nixp_load (NixpTree *tree, Arena *arena, const char *path, uint64_t key) {
+    NixpSnapHeader hdr;
+    struct stat    st;
+    char          *buf;
+    size_t         off, len;
+    int            fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) return -1;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(hdr) ||
+        pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, NIXP_SNAP_MAGIC, sizeof(hdr.magic)) != 0 || hdr.key != key) {
+        close(fd);
+        return -1;
+    }
+
+    // counts past the file would overflow the sizes below.
+    if (hdr.size > (uint64_t)st.st_size || hdr.nmore > (uint64_t)st.st_size) {
+        close(fd);
+        return -1;
+    }
+    len = sizeof(hdr) + snap_pad(hdr.size)
+        + snap_pad(sizeof(NixpSnapTok) * hdr.ntoks + sizeof(int32_t) * hdr.nmore)
+        + snap_pad(sizeof(unsigned) * hdr.ndepth) + sizeof(int) * hdr.ntoks;
+    if ((size_t)st.st_size != len || (buf = arena_alloc(arena, len)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    for (off = 0; off < len; ) {
+        ssize_t r = pread(fd, buf + off, len - off, off);
+        if (r <= 0) {
+            close(fd);
+            arena_free(arena, buf);
+            return -1;
+        }
+        off += r;
+    }
+    close(fd);
+
+    off = sizeof(hdr) + snap_pad(hdr.size);
+    const NixpSnapTok *stoks = (const NixpSnapTok *)(buf + off);
+    off += snap_pad(sizeof(NixpSnapTok) * hdr.ntoks + sizeof(int32_t) * hdr.nmore);
+    if (!snap_valid(&hdr, stoks, (const unsigned *)(buf + off),
+                    (const int *)(buf + off + snap_pad(sizeof(unsigned) * hdr.ndepth)))) {
+        arena_free(arena, buf);
+        return -1;
+    }
+
+    off         = sizeof(hdr);
+    tree->input = buf + off;
+    tree->size  = hdr.size;
+    tree->cap   = 0;
+    tree->ntoks = hdr.ntoks;
+    off        += snap_pad(hdr.size);
+
+    // rebuild tokens, indirect children go in blocks as `nixp_tree` does.
+    const int32_t *more = (const int32_t *)(stoks + hdr.ntoks);
+    arena_vec_init(&tree->toks, arena, sizeof(NixpToken), hdr.ntoks ? hdr.ntoks : 1);
+    for (unsigned i = 0; i < hdr.ntoks; ++i) {
+        NixpToken     *tok  = arena_vec_push(&tree->toks);
+        NixpChildren **link = &tok->more_children;
+        tok->type   = stoks[i].type;
+        tok->start  = stoks[i].start;
+        tok->end    = stoks[i].end;
+        tok->size   = stoks[i].size;
+        tok->parent = stoks[i].parent;
+        memcpy(tok->children, stoks[i].children, sizeof(tok->children));
+        *link = NULL;
+        for (int c = NIXP_TOK_DIRECT; c < tok->size; c += NIXP_TOK_INDIRECT) {
+            int n = tok->size - c < NIXP_TOK_INDIRECT ? tok->size - c : NIXP_TOK_INDIRECT;
+            *link = arena_calloc(arena, 1, sizeof(NixpChildren));
+            memcpy((*link)->children, more, sizeof(int32_t) * n);
+            more += n;
+            link  = &(*link)->next;
+        }
+    }
+    off += snap_pad(sizeof(NixpSnapTok) * hdr.ntoks + sizeof(int32_t) * hdr.nmore);
+
+    tree->ndepth = hdr.ndepth;
+    tree->dsize  = (unsigned *)(buf + off);
+    off         += snap_pad(sizeof(unsigned) * hdr.ndepth);
+    tree->dmap   = hdr.ndepth ? arena_alloc(arena, sizeof(int *) * hdr.ndepth) : NULL;
+    for (unsigned d = 0; d < hdr.ndepth; ++d) {
+        tree->dmap[d] = (int *)(buf + off);
+        off          += sizeof(int) * tree->dsize[d];
+    }
+    return 0;
+}
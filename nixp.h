@@ -1,7 +1,9 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include "arena.h"
 
 
 typedef enum {
@@ -18,6 +20,7 @@ typedef enum {
     NIX_DERIVATION,
     NIX_ELLIPSIS,
     NIX_NULL,
+    NIX_THUNK, // a value that was not evaluated yet.
 } NixpType;
 
 
@@ -34,7 +37,7 @@ typedef enum {
 
 typedef struct NixpChildren {
     struct NixpChildren *next;
-    unsigned             children[NIXP_TOK_DIRECT];
+    unsigned             children[NIXP_TOK_INDIRECT];
 } NixpChildren;
 
 
@@ -63,16 +66,17 @@ typedef struct {
     unsigned   offset; // offset in the input
     unsigned   next;   // next token to allocate
     int        super;  // superior node. e.g list or set.
-    unsigned   ntoks;  // total number of tokens in token pool
-    NixpToken *pool;   // token pool
+    ArenaVec   toks;   // token pool, tokens never move once allocated.
+    Arena     *arena;  // arena tokens and trees are allocated on.
 } NixpParser;
 
 
 typedef struct {
-    NixpToken  *tree;  // token pool
+    ArenaVec    toks;  // token pool
     unsigned    ntoks; // number of tokens
     const char *input; // input
     size_t      size;  // input size
+    size_t      cap;   // input capacity if grafts made the tree own it, 0 if not.
 
     /* We store the depth map to simplify the query.
      * The dmap contains 0 - depth entries, each entry
@@ -86,9 +90,18 @@ typedef struct {
 } NixpTree;
 
 
-void nixp_init (NixpParser *);
+static inline NixpToken *nixp_tok (const NixpParser *p, int i) { return arena_vec_at (&p->toks, i); }
+static inline NixpToken *nixp_tree_tok (const NixpTree *t, int i) { return arena_vec_at (&t->toks, i); }
+
+
+void nixp_init (NixpParser *, Arena *arena);
 int  nixp_parse (NixpParser *parser, const char *input, size_t size);
+int  nixp_parse_json (NixpParser *parser, char *input, size_t size);
+size_t nixp_unquote (char *s, size_t n);
 void nixp_tree (NixpTree *tree, NixpParser *p, const char *input, size_t size);
 void nixp_dump(FILE *fp, NixpTree *tree);
 int  nixp_tok_get_child(const NixpToken *tok, unsigned nth);
 int  nixp_access(NixpTree *tree, const char *path);
+int  nixp_graft (NixpTree *tree, const int *at, NixpTree *subs, unsigned n, Arena *arena);
+int  nixp_save (const NixpTree *tree, const char *path, uint64_t key);
+int  nixp_load (NixpTree *tree, Arena *arena, const char *path, uint64_t key);
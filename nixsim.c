@@ -0,0 +1,353 @@
+/* A stand-in for `nix repl`, for benchmarking kirby without nix.
+ *
+ *   nixsim [-s bytes] [-d depth] [-w width] [-e ns] [-i ms] [-c] [-H]
+ *
+ * It prints the banner and the `nix-repl> ` prompt, echoes what it is
+ * typed, answers assignments with an empty line and `:p` with a set of
+ * about `bytes` bytes. `:p builtins.attrNames …` prints the set's names,
+ * `:p ….m3.a1` the value at that path and `:p { _0 = if … }` answers a
+ * coalesced query for several paths. Queries with `builtins.toJSON`
+ * get the set as JSON, in a nix string. The set nests `depth` levels
+ * of `width` members and its leaves cycle through every kind of value
+ * nix prints, including «derivation …», «lambda @ …» and «repeated».
+ * With -c the values are coloured like nix does on a colour terminal.
+ * With -e every byte of output costs `ns` nanoseconds, standing in for
+ * the time nix spends evaluating it. With -i the first `:p` takes `ms`
+ * milliseconds more, like the import of home-manager and the module
+ * evaluation a fresh repl goes through once. With -H it ignores SIGHUP
+ * and never answers a `:p` of the whole set, like a repl stuck in an
+ * evaluation.
+ *
+ * Output is generated as it is written, so sizes of hundreds of MB do
+ * not need the memory.
+ * */
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROMPT "nix-repl> "
+#define OUTBUF (1 << 16)
+
+
+static char   out[OUTBUF];
+static size_t nout;
+static size_t total;   // bytes of the current value written so far.
+static bool   colour;
+static bool   quiet;   // count bytes without writing them.
+static long   cost;    // evaluation time per byte, in ns.
+static bool   json;    // print values as toJSON does, in a nix string.
+static long   cold;    // time the first evaluation takes, in ms.
+
+
+static void flush () {
+    char *p = out;
+    if (cost > 0) {
+        long long ns = (long long)nout * cost;
+        nanosleep (&(struct timespec){ ns / 1000000000, ns % 1000000000 }, NULL);
+    }
+    while (nout > 0) {
+        ssize_t r = write (1, p, nout);
+        if (r <= 0) exit (EXIT_FAILURE);
+        p    += r;
+        nout -= r;
+    }
+}
+
+
+/* Pieces are short, a few hundred bytes at most. */
+static void put (const char *s, size_t n) {
+    total += n;
+    if (quiet) return;
+    if (nout + n > OUTBUF) flush ();
+    memcpy (out + nout, s, n);
+    nout += n;
+}
+
+
+static void puts_ (const char *s) { put (s, strlen (s)); }
+
+
+/* Write `s` in `code`'s colour when colours are on. */
+static void coloured (const char *code, const char *s) {
+    if (colour) { puts_ ("\e["); puts_ (code); puts_ ("m"); }
+    puts_ (s);
+    if (colour) puts_ ("\e[0m");
+}
+
+
+/* Leaves cycle through these, so every kind shows up in every size. */
+static void leaf (unsigned long n) {
+    char buf[128];
+    switch (n % 9) {
+        case 0: coloured ("36;1", "true"); break;
+        case 1: coloured ("36;1", "false"); break;
+        case 2: snprintf (buf, sizeof(buf), "%lu", n); coloured ("36;1", buf); break;
+        case 3: snprintf (buf, sizeof(buf), "\"kirby-%lu\"", n); coloured ("35", buf); break;
+        case 4: coloured ("36", "null"); break;
+        case 5:
+            snprintf (buf, sizeof(buf), "«derivation /nix/store/%032lu-kirby-%lu.drv»", n, n);
+            coloured ("32;1", buf);
+            break;
+        case 6:
+            snprintf (buf, sizeof(buf), "«lambda @ /nix/store/%032lu-source/modules/kirby.nix:%lu:5»", n, n % 1000);
+            coloured ("34;1", buf);
+            break;
+        case 7: coloured ("35", "«repeated»"); break;
+        case 8:
+            puts_ ("[ ");
+            for (int i = 0; i < 3; ++i) {
+                snprintf (buf, sizeof(buf), "%lu", n + i);
+                coloured ("36;1", buf);
+                puts_ (" ");
+            }
+            puts_ ("]");
+            break;
+    }
+}
+
+
+/* A leaf as kirby's toJSON query prints it, quotes escaped as they are
+ * in the nix string around it. Functions and derivations are markers.
+ * */
+static void json_leaf (unsigned long n) {
+    char buf[128];
+    switch (n % 9) {
+        case 0: puts_ ("true"); break;
+        case 1: puts_ ("false"); break;
+        case 3: snprintf (buf, sizeof(buf), "\\\"kirby-%lu\\\"", n); puts_ (buf); break;
+        case 4: puts_ ("null"); break;
+        case 5:
+            snprintf (buf, sizeof(buf), "\\\"«derivation /nix/store/%032lu-kirby-%lu.drv»\\\"", n, n);
+            puts_ (buf);
+            break;
+        case 6: puts_ ("\\\"«lambda»\\\""); break;
+        case 8: snprintf (buf, sizeof(buf), "[%lu,%lu,%lu]", n, n + 1, n + 2); puts_ (buf); break;
+        default: snprintf (buf, sizeof(buf), "%lu", n); puts_ (buf); break;
+    }
+}
+
+
+static void set (int depth, int width, unsigned long *n) {
+    char key[32];
+    if (json) {
+        puts_ ("{");
+        for (int i = 0; i < width; ++i) {
+            snprintf (key, sizeof(key), "%s\\\"a%d\\\":", i ? "," : "", i);
+            puts_ (key);
+            if (depth > 1) set (depth - 1, width, n);
+            else json_leaf ((*n)++);
+        }
+        puts_ ("}");
+        return;
+    }
+    puts_ ("{ ");
+    for (int i = 0; i < width; ++i) {
+        snprintf (key, sizeof(key), "a%d = ", i);
+        puts_ (key);
+        if (depth > 1) set (depth - 1, width, n);
+        else leaf ((*n)++);
+        puts_ ("; ");
+    }
+    puts_ ("}");
+}
+
+
+/* Print a set of at least one member and about `size` bytes, or of
+ * `count` members if it is not 0. Returns the number of members.
+ * */
+static unsigned long value (size_t size, unsigned long count, int depth, int width) {
+    char          key[32];
+    unsigned long n = 0;
+    unsigned long i;
+    total = 0;
+    puts_ (json ? "\"{" : "{ ");
+    for (i = 0; count > 0 ? i < count : i == 0 || total < size; ++i) {
+        snprintf (key, sizeof(key), json ? "%s\\\"m%lu\\\":" : "%sm%lu = ", json && i ? "," : "", i);
+        puts_ (key);
+        set (depth, width, &n);
+        if (!json) puts_ ("; ");
+    }
+    puts_ (json ? "}\"" : "}");
+    return i;
+}
+
+
+static unsigned long members (size_t size, int depth, int width) {
+    unsigned long m;
+    quiet = true;
+    m     = value (size, 0, depth, width);
+    quiet = false;
+    return m;
+}
+
+
+/* Print the names of the `m` members `value` prints. */
+static void names (unsigned long m) {
+    char key[32];
+    puts_ ("[ ");
+    for (unsigned long i = 0; i < m; ++i) {
+        snprintf (key, sizeof(key), "\"m%lu\" ", i);
+        coloured ("35", key);
+    }
+    puts_ ("]");
+}
+
+
+/* Find the value at `path`, like `m3.a1`, among `members` members.
+ * Leaves are numbered in order, so the first leaf under a path is
+ * known: it is left in `n`, with the depth of the value in `depth`.
+ * */
+static bool locate (const char *path, unsigned long members, int *depth, int width, unsigned long *n) {
+    unsigned long i;
+    char         *end;
+
+    *n = 1;
+    for (int d = 0; d < *depth; ++d) *n *= width; // leaves per member.
+    if (sscanf (path, "m%lu", &i) != 1 || i >= members) return false;
+    *n *= i;
+    for (path = strchr (path, '.'); path != NULL; path = strchr (path + 1, '.'), --*depth) {
+        unsigned long j = strtoul (path + 2, &end, 10), leaves = 1;
+        if (*depth == 0 || path[1] != 'a' || j >= (unsigned long)width) return false;
+        for (int d = 1; d < *depth; ++d) leaves *= width;
+        *n += j * leaves;
+    }
+    return true;
+}
+
+
+/* Print the value at `path` among `m` members as `value` would. */
+static void subvalue (const char *path, unsigned long m, int depth, int width) {
+    unsigned long n;
+    if (!locate (path, m, &depth, width, &n)) puts_ ("error: attribute missing");
+    else if (depth > 0) set (depth, width, &n);
+    else leaf (n);
+}
+
+
+static int cmp_name (const void *a, const void *b) { return strcmp (*(char *const *)a, *(char *const *)b); }
+
+
+/* Answer a coalesced query, `{ _0 = if … ? "m1"."a2" then [ … ] else
+ * [ ]; … }`, with a list of the value for every path that exists. Nix
+ * prints names sorted, so `_10` comes before `_2`.
+ * */
+static void paths (const char *line, unsigned long m, int depth, int width) {
+    static const char cond[] = " = if hm.config.kirby ? ";
+    static char      *found[4096];
+    unsigned long     n;
+    int               nfound = 0;
+
+    for (const char *c = strstr (line, cond); c != NULL && nfound < 4096; c = strstr (c + 1, cond)) {
+        const char *name = c, *end = strstr (c, " then ");
+        char        path[256];
+        size_t      k = 0;
+        while (name[-1] != '_') --name;
+        for (const char *p = c + strlen (cond); p < end && k < sizeof(path) - 1; ++p) {
+            if (*p != '"') path[k++] = *p;
+        }
+        path[k] = '\0';
+        found[nfound] = malloc (c - name + 2 + k + 1);
+        sprintf (found[nfound++], "_%.*s %s", (int)(c - name), name, path);
+    }
+    qsort (found, nfound, sizeof(char *), cmp_name);
+
+    puts_ ("{ ");
+    for (int i = 0; i < nfound; ++i) {
+        char *path = strchr (found[i], ' ');
+        int   d    = depth;
+        *path++ = '\0';
+        puts_ (found[i]);
+        puts_ (" = [ ");
+        if (locate (path, m, &d, width, &n)) {
+            if (d > 0) set (d, width, &n);
+            else leaf (n);
+            puts_ (" ");
+        }
+        puts_ ("]; ");
+        free (found[i]);
+    }
+    puts_ ("}");
+}
+
+
+int main (int argc, char **argv) {
+    size_t        size  = 1024;
+    int           depth = 2;
+    int           width = 4;
+    bool          hang  = false;
+    unsigned long m;       // members of the set.
+    int           opt;
+    char          line[1 << 16];
+    size_t        len = 0;
+    char          c;
+
+    while ((opt = getopt (argc, argv, "s:d:w:e:i:cH")) != -1) {
+        switch (opt) {
+            case 's': size   = strtoull (optarg, NULL, 0); break;
+            case 'd': depth  = atoi (optarg); break;
+            case 'w': width  = atoi (optarg); break;
+            case 'e': cost   = atol (optarg); break;
+            case 'i': cold   = atol (optarg); break;
+            case 'c': colour = true; break;
+            case 'H': hang   = true; break;
+            default:
+                fprintf (stderr, "usage: %s [-s bytes] [-d depth] [-w width] [-e ns] [-i ms] [-c] [-H]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (depth < 1) depth = 1;
+    if (width < 1) width = 1;
+    if (hang) signal (SIGHUP, SIG_IGN);
+    m = members (size, depth, width); // counting generates the whole set, so only once.
+
+    puts_ ("Welcome to Nix 2.18.1. Type :? for help.\n\n" PROMPT);
+    flush ();
+
+    // the repl reads one key at a time and echoes it.
+    while (read (0, &c, 1) == 1) {
+        if (c != '\r' && c != '\n') {
+            if (len < sizeof(line)) line[len++] = c;
+            put (&c, 1);
+            flush ();
+            continue;
+        }
+        puts_ ("\n");
+        if (len >= 2 && memcmp (line, ":p", 2) == 0) {
+            char *sel;
+            line[len < sizeof(line) ? len : len - 1] = '\0';
+            if (cold > 0) {
+                nanosleep (&(struct timespec){ cold / 1000, cold % 1000 * 1000000 }, NULL);
+                cold = 0;
+            }
+            if (strstr (line, "builtins.toJSON") != NULL) {
+                // the same members as `:p`, JSON is shorter.
+                json = true;
+                if (colour) puts_ ("\e[35m");
+                value (size, m, depth, width);
+                if (colour) puts_ ("\e[0m");
+                json = false;
+            }
+            else if (strstr (line, "builtins.attrNames") != NULL) names (m);
+            else if (memcmp (line, ":p { _", 6) == 0) paths (line, m, depth, width);
+            else if ((sel = strstr (line, "kirby.")) != NULL) {
+                // names come quoted, `"m3"."a1"`.
+                char *k = sel += strlen ("kirby.");
+                for (char *c = sel; *c != '\0'; ++c) if (*c != '"') *k++ = *c;
+                *k = '\0';
+                subvalue (sel, m, depth, width);
+            }
+            else if (hang) for (;;) pause ();
+            else value (size, 0, depth, width);
+            puts_ ("\n");
+        }
+        puts_ ("\n" PROMPT);
+        flush ();
+        len = 0;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+/* Spawn latency of exp_spawnvf, posix_spawn against fork/exec, and
+ * against fork/exec closing inherited fds one by one as it did before
+ * close_range.
+ *
+ *   make spawnbench && ./spawnbench [heap MiB] [open fds]
+ *
+ * Each round spawns `true` on a fresh pty and reaps it once it exits. A large parent
+ * heap makes fork copy more page tables, open fds make closing them
+ * one by one more expensive.
+ * */
+#define _GNU_SOURCE
+#include "expect.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUNDS 200
+
+
+static double now_ms () {
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+
+static void bench (const char *name, unsigned flags) {
+    double t = now_ms ();
+    for (int i = 0; i < ROUNDS; ++i) {
+        exp_h *h = exp_spawnlf (flags, "true", "true", NULL);
+        if (h == NULL) {
+            perror ("exp_spawnlf");
+            exit (EXIT_FAILURE);
+        }
+        // wait for `true` to exit, closing the pty first would SIGHUP it.
+        if (exp_expect (h, NULL, NULL) != EXP_EOF) abort ();
+        exp_close (h);
+    }
+    printf ("%-12s %8.3f ms/spawn\n", name, (now_ms () - t) / ROUNDS);
+}
+
+
+int main (int argc, char **argv) {
+    size_t heap  = (argc > 1 ? atol (argv[1]) : 1024) << 20;
+    int    nfds  = argc > 2 ? atoi (argv[2]) : 1000;
+    char  *p     = malloc (heap);
+    struct rlimit rl;
+
+    memset (p, 1, heap); // fault the heap in, fork has to copy its page tables.
+    getrlimit (RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit (RLIMIT_NOFILE, &rl);
+    for (int i = 0; i < nfds; ++i) open ("/dev/null", O_RDONLY);
+    printf ("heap %zu MiB, %d fds, fd limit %lu\n", heap >> 20, nfds, (unsigned long)rl.rlim_cur);
+
+    bench ("posix_spawn", 0);
+    bench ("fork", EXP_SPAWN_USE_FORK);
+    bench ("fork + loop", EXP_SPAWN_USE_FORK | EXP_SPAWN_CLOSE_LOOP);
+    free (p);
+}